@@ -1,18 +1,29 @@
 #include "AddressResolver.h"
 
 #include <algorithm>
-#include <map>
-#ifndef NDEBUG
+#include <deque>
+#include <fstream>
 #include <iostream>
-#endif
+#include <limits>
+#include <map>
+#include <memory>
 #include <sstream>
+#include <unordered_map>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
 #include <cstring>
 
 #include <cxxabi.h>
 
+#include <dwarf.h>
 #include <elfutils/libdwfl.h>
+#include <zlib.h>
 
+#include <dirent.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 
@@ -24,6 +35,7 @@ enum Section {
   PLT,
   RelPLT,
   RelAPLT,
+  BuildIdNote,
   SectionCount
 };
 
@@ -38,6 +50,8 @@ public:
 
   Elf* get() { return elf_; }
   Elf_Scn* getSection(Section section) { return sections_[section]; }
+  std::string getBuildId();
+  bool getDebugLink(std::string& name, uint32_t& crc);
   uint64_t getBaseAddress() const { return baseAddress_; }
   Address getEndAddress() const { return endAddress_; }
   bool usesAbsoluteAddresses() const { return usesAbsoluteAddresses_; }
@@ -53,7 +67,7 @@ private:
   Elf* elf_;
   Elf_Scn* sections_[SectionCount];
   int fd_;
-  bool usesAbsoluteAddresses_;
+  bool usesAbsoluteAddresses_ = false;
 };
 
 ElfHolder::ElfHolder(const char *fileName)
@@ -92,6 +106,8 @@ void ElfHolder::close()
   elf_ = 0;
   fd_ = -1;
   baseAddress_ = 0;
+  endAddress_ = 0;
+  usesAbsoluteAddresses_ = false;
   memset(sections_, 0, sizeof(sections_));
 }
 
@@ -158,6 +174,14 @@ void ElfHolder::loadInfo()
         needToFind--;
       }
       break;
+    case SHT_NOTE:
+      sectionName = elf_strptr(elf_, ehdr.e_shstrndx, shdr.sh_name);
+      if (strcmp(sectionName, ".note.gnu.build-id") == 0)
+      {
+        sections_[BuildIdNote] = scn;
+        needToFind--;
+      }
+      break;
     case SHT_REL:
       sectionName = elf_strptr(elf_, ehdr.e_shstrndx, shdr.sh_name);
       if (strcmp(sectionName, ".rel.plt") == 0)
@@ -178,9 +202,56 @@ void ElfHolder::loadInfo()
   }
 }
 
+std::string ElfHolder::getBuildId()
+{
+  Elf_Data* noteData = sections_[BuildIdNote] ? elf_getdata(sections_[BuildIdNote], 0) : 0;
+  if (!noteData)
+    return std::string();
+
+  size_t offset = 0;
+  GElf_Nhdr note;
+  size_t nameOffset, descOffset;
+  while ((offset = gelf_getnote(noteData, offset, &note, &nameOffset, &descOffset)) > 0)
+  {
+    const unsigned char* noteBytes = static_cast<const unsigned char*>(noteData->d_buf);
+    if (note.n_type != NT_GNU_BUILD_ID || note.n_namesz != 4 || memcmp(noteBytes + nameOffset, "GNU", 4) != 0)
+      continue;
+
+    static const char hexDigits[] = "0123456789abcdef";
+    std::string buildId;
+    for (size_t i = 0; i < note.n_descsz; i++)
+    {
+      buildId.push_back(hexDigits[noteBytes[descOffset + i] >> 4]);
+      buildId.push_back(hexDigits[noteBytes[descOffset + i] & 0xf]);
+    }
+    return buildId;
+  }
+
+  return std::string();
+}
+
+bool ElfHolder::getDebugLink(std::string& name, uint32_t& crc)
+{
+  // File name padded to 4 bytes followed by CRC32 of the debug file
+  Elf_Data* linkData = sections_[DebugLink] ? elf_getdata(sections_[DebugLink], 0) : 0;
+  if (!linkData || !linkData->d_buf)
+    return false;
+
+  const char* linkBytes = static_cast<const char*>(linkData->d_buf);
+  const size_t nameLength = strnlen(linkBytes, linkData->d_size);
+  const size_t crcOffset = (nameLength + 4) & ~size_t(3);
+  if (nameLength == 0 || crcOffset + sizeof(crc) > linkData->d_size)
+    return false;
+
+  name.assign(linkBytes, nameLength);
+  memcpy(&crc, linkBytes + crcOffset, sizeof(crc));
+  return true;
+}
+
 struct ARSymbolData
 {
   static constexpr unsigned char MiscPLT = 255;
+  static constexpr unsigned char MiscLabel = 254;
   explicit ARSymbolData(const GElf_Sym& elfSymbol)
     : size(elfSymbol.st_size)
     , misc(GELF_ST_BIND(elfSymbol.st_info))
@@ -190,12 +261,322 @@ struct ARSymbolData
   {}
   ARSymbolData() {}
   uint64_t size;
-  std::string name;
+  // Points to the string table of ELF file or to the cache mapping, name is materialized only when symbol is hit
+  const char* name = nullptr;
   unsigned char misc = 0;
 };
 
-typedef std::map<Range, ARSymbolData> ARSymbolStorage;
-typedef ARSymbolStorage::value_type ARSymbol;
+// Symbols are collected into map while loading, it resolves overlaps between symbol tables
+typedef std::map<Range, ARSymbolData> ARSymbolMap;
+// ... and are kept in flat sorted array for resolving
+typedef std::pair<Range, ARSymbolData> ARSymbol;
+typedef std::vector<ARSymbol> ARSymbolStorage;
+
+static bool symbolEndsBefore(const ARSymbol& symbol, Address address)
+{
+  return symbol.first.end() <= address;
+}
+
+/// Row of the line table
+struct ARLine
+{
+  Dwarf_Addr address;
+  const char* sourceFile;
+  int sourceLine;
+  bool endSequence;
+};
+
+typedef std::vector<ARLine> ARLineTable;
+
+/// Innermost inlined functions by address, every key starts a range lasting till the next one
+typedef std::map<Dwarf_Addr, const InlinedCalls*> ARInlineTable;
+
+/// Address range covered by compile unit
+struct ARCompileUnit
+{
+  Dwarf_Addr start;
+  Dwarf_Addr end;
+  Dwarf_Off dieOffset;
+  bool operator<(const ARCompileUnit& rhs) const { return start < rhs.start; }
+};
+
+/// On-disk symbol cache layout: header, records sorted by address, then names
+/** Names are stored demangled, suffixes like "@plt" are added when resolving. Cache is native endian and is just
+ *  rebuilt when it can't be used. */
+struct SymbolCacheHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+  uint64_t symbolCount;
+  uint64_t namesSize;
+};
+
+struct SymbolCacheRecord
+{
+  uint64_t start;
+  uint64_t end;
+  uint32_t nameOffset;
+  uint32_t misc;
+};
+
+static const char symbolCacheMagic[8] = {'P', 'G', 'S', 'Y', 'M', 'T', 'A', 'B'};
+static const uint32_t symbolCacheVersion = 1;
+static const uint32_t symbolCacheNoName = UINT32_MAX;
+// Cache was built from .symtab, otherwise only .dynsym was available
+static const uint32_t symbolCacheFullSymTab = 1;
+
+/// Symbol pack layout: header, then objects one after another
+/** Every object is its header, key (build-id or file name), symbols covering hit addresses in the symbol cache layout,
+ *  line table rows for ranges of these symbols and source file names. All parts are padded to 8 bytes. */
+struct SymbolPackHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t objectCount;
+};
+
+struct SymbolPackObject
+{
+  uint64_t size;
+  uint64_t baseAddress;
+  uint64_t endAddress;
+  uint32_t flags;
+  uint32_t keySize;
+  uint64_t symbolTableSize;
+  uint64_t lineCount;
+  uint64_t sourceFilesSize;
+};
+
+struct SymbolPackLine
+{
+  uint64_t address;
+  uint32_t sourceFileOffset;
+  int32_t sourceLine;
+};
+
+static const char symbolPackMagic[8] = {'P', 'G', 'S', 'Y', 'M', 'P', 'A', 'K'};
+static const uint32_t symbolPackVersion = 1;
+static const uint32_t symbolPackAbsoluteAddresses = 1;
+// Special source file offsets of line rows
+static const uint32_t symbolPackEndSequence = UINT32_MAX;
+static const uint32_t symbolPackNoSourceFile = UINT32_MAX - 1;
+
+static size_t alignTo8(const size_t size)
+{
+  return (size + 7) & ~size_t(7);
+}
+
+static std::string demangle(const char* name)
+{
+  char* demangledName = __cxxabiv1::__cxa_demangle(name, 0, 0, 0);
+  if (!demangledName)
+    return name;
+
+  std::string result(demangledName);
+  free(demangledName);
+  return result;
+}
+
+/// Appends symbols in the cache layout, it is shared by symbol cache files and symbol packs
+static void appendSymbolTable(std::string& out, const ARSymbolStorage& symbols, const bool demangleNames,
+                              const bool fullSymTab)
+{
+  std::vector<SymbolCacheRecord> records;
+  records.reserve(symbols.size());
+  std::string names;
+  for (const auto& symbol: symbols)
+  {
+    SymbolCacheRecord record = {symbol.first.start(), symbol.first.end(), symbolCacheNoName, symbol.second.misc};
+    if (symbol.second.name && *symbol.second.name)
+    {
+      record.nameOffset = names.size();
+      if (!demangleNames || symbol.second.misc == ARSymbolData::MiscLabel)
+        names.append(symbol.second.name);
+      else
+        names.append(demangle(symbol.second.name));
+      names.push_back(0);
+    }
+    records.push_back(record);
+  }
+
+  SymbolCacheHeader header;
+  memcpy(header.magic, symbolCacheMagic, sizeof(symbolCacheMagic));
+  header.version = symbolCacheVersion;
+  header.flags = fullSymTab ? symbolCacheFullSymTab : 0;
+  header.symbolCount = records.size();
+  header.namesSize = names.size();
+
+  out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.append(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(SymbolCacheRecord));
+  out.append(names);
+}
+
+static bool makeDirectories(const std::string& path)
+{
+  for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1))
+  {
+    const std::string& dir = path.substr(0, pos);
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+      return false;
+    if (pos == std::string::npos)
+      return true;
+  }
+}
+
+// Jitdump format is described in tools/perf/Documentation/jitdump-specification.txt of the Linux kernel
+struct JitDumpHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t totalSize;
+  uint32_t elfMach;
+  uint32_t pad1;
+  uint32_t pid;
+  uint64_t timestamp;
+  uint64_t flags;
+};
+
+struct JitDumpRecordHeader
+{
+  uint32_t id;
+  uint32_t totalSize;
+  uint64_t timestamp;
+};
+
+struct JitDumpCodeLoad
+{
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t codeAddress;
+  uint64_t codeSize;
+  uint64_t codeIndex;
+  // Followed by null terminated name and code
+};
+
+struct JitDumpCodeMove
+{
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t oldCodeAddress;
+  uint64_t newCodeAddress;
+  uint64_t codeSize;
+  uint64_t codeIndex;
+};
+
+static const uint32_t jitDumpMagic = 0x4A695444;
+static const uint64_t jitDumpArchTimestamp = 1;
+enum JitDumpRecordType {
+  JitCodeLoad = 0,
+  JitCodeMove = 1,
+  JitCodeClose = 3
+};
+
+JitCode::JitCode(const uint32_t pid, const std::vector<std::string>& jitDumpFiles, const Address syntheticStart)
+: pid_(pid)
+, syntheticStart_(syntheticStart)
+{
+  loadPerfMap("/tmp/perf-" + std::to_string(pid) + ".map");
+  for (const auto& jitDumpFile: jitDumpFiles)
+    loadJitDump(jitDumpFile);
+
+  // Function replaced even partially is moved as a whole, so its samples stay together
+  syntheticEnd_ = syntheticStart;
+  for (Function& function: functions_)
+  {
+    if (functionSpace_.isLatest(function.range, &function))
+      continue;
+    function.placedStart = syntheticEnd_;
+    syntheticEnd_ += function.range.length();
+  }
+}
+
+Address JitCode::place(const Address address, const uint64_t time) const
+{
+  const Function* function = functionSpace_.find(address, time);
+  return function ? address - function->range.start() + function->placedStart : address;
+}
+
+void JitCode::insert(const Range& range, const uint64_t time, const char* name)
+{
+  functions_.push_back(Function{range, range.start(), name});
+  functionSpace_.insert(range, time, &functions_.back());
+}
+
+/// Reads "start size name" lines written by JIT compilers for perf, addresses and sizes are in hex
+void JitCode::loadPerfMap(const std::string& fileName)
+{
+  std::ifstream is(fileName);
+  std::string line;
+  while (std::getline(is, line))
+  {
+    const char* startStr = line.c_str();
+    char* sizeStr;
+    char* nameStr;
+    const Address start = strtoull(startStr, &sizeStr, 16);
+    const Size size = strtoull(sizeStr, &nameStr, 16);
+    if (sizeStr == startStr || nameStr == sizeStr || *nameStr != ' ' || size == 0)
+      continue;
+
+    names_.emplace_back(nameStr + 1);
+    insert(Range(start, start + size), 0, names_.back().c_str());
+  }
+}
+
+/// Reads code load and move records one by one, code and debug info are skipped
+void JitCode::loadJitDump(const std::string& fileName)
+{
+  std::ifstream is(fileName, std::ios_base::binary);
+  JitDumpHeader header;
+  if (!is.read(reinterpret_cast<char*>(&header), sizeof(header)))
+    return;
+  if (header.magic != jitDumpMagic || header.totalSize < sizeof(header))
+  {
+    std::cerr << "Unsupported jitdump file " << fileName << '\n';
+    return;
+  }
+  is.ignore(header.totalSize - sizeof(header));
+
+  // Timestamps read from the CPU counter can't be compared with times of samples, such records come in the order of
+  // execution anyway
+  const bool useTimestamps = !(header.flags & jitDumpArchTimestamp);
+
+  // Moved code keeps its name, the old place becomes a hole
+  std::unordered_map<uint64_t, const char*> codeNames;
+  JitDumpRecordHeader record;
+  while (is.read(reinterpret_cast<char*>(&record), sizeof(record)) && record.totalSize >= sizeof(record) &&
+         record.id != JitCodeClose)
+  {
+    size_t remaining = record.totalSize - sizeof(record);
+    const uint64_t time = useTimestamps ? record.timestamp : 0;
+    if (record.id == JitCodeLoad && remaining >= sizeof(JitDumpCodeLoad))
+    {
+      JitDumpCodeLoad load;
+      is.read(reinterpret_cast<char*>(&load), sizeof(load));
+      names_.emplace_back();
+      std::getline(is, names_.back(), '\0');
+      remaining -= std::min(remaining, sizeof(load) + names_.back().size() + 1);
+      if (load.codeSize)
+        insert(Range(load.codeAddress, load.codeAddress + load.codeSize), time, names_.back().c_str());
+      codeNames[load.codeIndex] = names_.back().c_str();
+    }
+    else if (record.id == JitCodeMove && remaining >= sizeof(JitDumpCodeMove))
+    {
+      JitDumpCodeMove move;
+      is.read(reinterpret_cast<char*>(&move), sizeof(move));
+      remaining -= sizeof(move);
+      const auto nameIt = codeNames.find(move.codeIndex);
+      if (nameIt != codeNames.end() && move.codeSize)
+      {
+        functionSpace_.insert(Range(move.oldCodeAddress, move.oldCodeAddress + move.codeSize), time, nullptr);
+        insert(Range(move.newCodeAddress, move.newCodeAddress + move.codeSize), time, nameIt->second);
+      }
+    }
+    is.ignore(remaining);
+  }
+}
 
 class AddressResolverPrivate
 {
@@ -207,20 +588,60 @@ public:
   , dwMod(0)
   , dwBias(0)
   {}
+  ~AddressResolverPrivate();
 
   void loadPLTSymbols(Elf* elf, Elf_Scn* pltSection, Elf_Scn* relPltSection, Elf_Scn *dynsymSection);
   void loadSymbolsFromSection(Elf* elf, Elf_Scn* section);
-  const char* getDebugLink(Elf_Scn* section);
 
-  void constructFakeSymbols(ProfileDetails details, Address endAddress, const char* baseName);
+  void constructFakeSymbols(ProfileDetails details, Address endAddress);
+
+  bool loadSymbolTable(const char* data, size_t size, bool fullSymTabAvailable);
+  bool loadSymbolCache(const std::string& cacheFileName, bool fullSymTabAvailable);
+  void saveSymbolCache(const std::string& cacheDir, const std::string& cacheFileName, bool fullSymTab) const;
+  void loadSymbolPackObject(ProfileDetails details, const SymbolPackObject& object);
+
+  const std::string& symbolName(const ARSymbol& symbol);
 
   uint64_t baseAddress;
+  Address endAddress = 0;
   uint64_t pltEndAddress;
+  std::string baseName;
+  // Symbols loaded from cache already have demangled names
+  bool namesDemangled = false;
+
+  // Symbol names point to string tables of these files
+  std::unique_ptr<ElfHolder> elfFile;
+  std::unique_ptr<ElfHolder> debugElfFile;
+  // ... or to the loaded symbol cache
+  void* cacheMapping = MAP_FAILED;
+  size_t cacheMappingSize = 0;
+  // ... or to names of JIT generated code
+  std::shared_ptr<const JitCode> jitCode;
+  // Entry of the file in symbol pack
+  std::string packKey;
+
+  // Names of the symbols which were hit at least once
+  std::unordered_map<const ARSymbol*, std::string> materializedNames;
 
   Dwfl* dwfl;
   Dwfl_Module* dwMod;
   GElf_Addr dwBias;
-
+  Dwarf* dwarf = nullptr;
+
+  // Compile units are indexed by address ranges, line tables are decoded only for units with hits
+  bool compileUnitsLoaded = false;
+  std::vector<ARCompileUnit> compileUnits;
+  std::unordered_map<Dwarf_Off, ARLineTable> lineTables;
+  // ... so are inlined subroutines
+  std::unordered_map<Dwarf_Off, ARInlineTable> inlineTables;
+  std::deque<InlinedCalls> inlinedCalls;
+
+  void loadCompileUnits();
+  const ARLineTable& lineTable(Dwarf_Off cuDieOffset);
+  const ARInlineTable& inlineTable(Dwarf_Off cuDieOffset);
+  void collectInlinedCalls(Dwarf_Die* parent, Dwarf_Files* files, InlinedCalls& chain, ARInlineTable& table);
+
+  ARSymbolMap loadedSymbols;
   ARSymbolStorage symbols;
 };
 
@@ -231,68 +652,364 @@ static Dwfl_Callbacks callbacks = {
   0
 };
 
-AddressResolver::AddressResolver(const ProfileDetails details, const char* fileName)
-: d(new AddressResolverPrivate)
+std::string SymbolLocations::defaultCacheDir()
+{
+  const char* xdgCacheHome = getenv("XDG_CACHE_HOME");
+  if (xdgCacheHome && *xdgCacheHome)
+    return std::string(xdgCacheHome) + "/perfgrind";
+
+  const char* home = getenv("HOME");
+  if (home && *home)
+    return std::string(home) + "/.cache/perfgrind";
+
+  return std::string();
+}
+
+static const char* const systemDebugDir = "/usr/lib/debug";
 
+static bool isRegularFile(const std::string& fileName)
 {
-  elf_version(EV_CURRENT);
-  ElfHolder elfh(fileName);
-  d->baseAddress = elfh.getBaseAddress();
-  usesAbsoluteAddresses_ = elfh.usesAbsoluteAddresses();
+  struct stat st;
+  return stat(fileName.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+static bool isElfFile(const std::string& fileName)
+{
+  char magic[SELFMAG];
+  const int fd = ::open(fileName.c_str(), O_RDONLY);
+  if (fd == -1)
+    return false;
+  const bool isElf = read(fd, magic, SELFMAG) == SELFMAG && memcmp(magic, ELFMAG, SELFMAG) == 0;
+  ::close(fd);
+  return isElf;
+}
+
+static bool fileCrcMatches(const std::string& fileName, const uint32_t crc)
+{
+  const int fd = ::open(fileName.c_str(), O_RDONLY);
+  if (fd == -1)
+    return false;
+
+  uLong fileCrc = crc32(0, Z_NULL, 0);
+  std::vector<Bytef> buffer(1 << 16);
+  ssize_t bytesRead;
+  while ((bytesRead = read(fd, buffer.data(), buffer.size())) > 0)
+    fileCrc = crc32(fileCrc, buffer.data(), bytesRead);
+  ::close(fd);
+
+  return bytesRead == 0 && fileCrc == crc;
+}
+
+static void indexDebugDir(const std::string& dirName, std::unordered_map<std::string, std::string>& byBuildId,
+                          std::unordered_multimap<std::string, std::string>& byName)
+{
+  DIR* dir = opendir(dirName.c_str());
+  if (!dir)
+    return;
 
-  if (details != ProfileDetails::Objects && elfh.getSection(PLT) && elfh.getSection(DynSym))
+  while (dirent* dirEntry = readdir(dir))
   {
-    if (elfh.getSection(RelPLT))
-      d->loadPLTSymbols(elfh.get(), elfh.getSection(PLT), elfh.getSection(RelPLT), elfh.getSection(DynSym));
-    if (elfh.getSection(RelAPLT))
-      d->loadPLTSymbols(elfh.get(), elfh.getSection(PLT), elfh.getSection(RelAPLT), elfh.getSection(DynSym));
+    if (strcmp(dirEntry->d_name, ".") == 0 || strcmp(dirEntry->d_name, "..") == 0)
+      continue;
+
+    const std::string& path = dirName + '/' + dirEntry->d_name;
+    struct stat st;
+    // Symbolic links are not followed, .build-id directories consist of them
+    if (lstat(path.c_str(), &st) != 0)
+      continue;
+    if (S_ISDIR(st.st_mode))
+      indexDebugDir(path, byBuildId, byName);
+    else if (S_ISREG(st.st_mode) && isElfFile(path))
+    {
+      ElfHolder elfh(path.c_str());
+      const std::string& buildId = elfh.getBuildId();
+      if (!buildId.empty())
+        byBuildId.emplace(buildId, path);
+      byName.emplace(dirEntry->d_name, path);
+    }
   }
 
-  // Don't load symbols if not requested
-  bool symTabLoaded = (details == ProfileDetails::Objects);
-  // Try to load .symtab from main file
-  if (!symTabLoaded && elfh.getSection(SymTab))
+  closedir(dir);
+}
+
+void SymbolLocations::indexDebugDirs() const
+{
+  for (const auto& debugDir: debugDirs)
+    indexDebugDir(debugDir, debugFilesByBuildId_, debugFilesByName_);
+}
+
+std::string SymbolLocations::findExecutable(const std::string& fileName, const std::string& buildId) const
+{
+  if (!storeDir.empty() && !buildId.empty())
   {
-    d->loadSymbolsFromSection(elfh.get(), elfh.getSection(SymTab));
-    symTabLoaded = true;
+    const std::string& candidate = storeDir + '/' + buildId + "/executable";
+    if (isRegularFile(candidate))
+      return candidate;
   }
-  else if (!symTabLoaded && elfh.getSection(DynSym))
-    // Try to load .dynsym from main file
-    d->loadSymbolsFromSection(elfh.get(), elfh.getSection(DynSym));
 
-  std::string debugModuleName = fileName;
-  if (details != ProfileDetails::Objects && elfh.getSection(DebugLink))
+  return fileName;
+}
+
+std::string SymbolLocations::findDebugFile(const std::string& fileName, const std::string& buildId,
+                                           const std::string& debugLink, const uint32_t debugLinkCrc) const
+{
+  if (!storeDir.empty() && !buildId.empty())
   {
-    // Get name
-    debugModuleName = "/usr/lib/debug";
-    debugModuleName.append(fileName);
-    debugModuleName.append(".debug");
-    /// @todo Use debug link
+    const std::string& candidate = storeDir + '/' + buildId + "/debuginfo";
+    if (isRegularFile(candidate))
+      return candidate;
+  }
+
+  std::vector<std::string> debugRoots(1, systemDebugDir);
+  debugRoots.insert(debugRoots.end(), debugDirs.begin(), debugDirs.end());
 
-    if (!symTabLoaded)
+  // Directories are walked only once, all resolvers share the index
+  std::call_once(debugDirsIndexed_, &SymbolLocations::indexDebugDirs, this);
+
+  if (buildId.size() > 2)
+  {
+    for (const auto& debugRoot: debugRoots)
     {
-      elfh.close();
-      elfh.open(debugModuleName.c_str());
-      if (elfh.getSection(SymTab))
-        d->loadSymbolsFromSection(elfh.get(), elfh.getSection(SymTab));
+      const std::string& candidate =
+        debugRoot + "/.build-id/" + buildId.substr(0, 2) + '/' + buildId.substr(2) + ".debug";
+      if (isRegularFile(candidate))
+        return candidate;
     }
+
+    const auto indexIt = debugFilesByBuildId_.find(buildId);
+    if (indexIt != debugFilesByBuildId_.end())
+      return indexIt->second;
+  }
+
+  if (!debugLink.empty())
+  {
+    // Same places as gdb looks into
+    const std::string objectDir = fileName.substr(0, fileName.rfind('/'));
+    std::vector<std::string> candidates;
+    candidates.push_back(objectDir + '/' + debugLink);
+    candidates.push_back(objectDir + "/.debug/" + debugLink);
+    for (const auto& debugRoot: debugRoots)
+      candidates.push_back(debugRoot + objectDir + '/' + debugLink);
+    const auto indexRange = debugFilesByName_.equal_range(debugLink);
+    for (auto indexIt = indexRange.first; indexIt != indexRange.second; ++indexIt)
+      candidates.push_back(indexIt->second);
+
+    for (const auto& candidate: candidates)
+    {
+      if (candidate != fileName && isRegularFile(candidate) && fileCrcMatches(candidate, debugLinkCrc))
+        return candidate;
+    }
+  }
+
+  return std::string();
+}
+
+SymbolLocations::~SymbolLocations()
+{
+  if (symbolPackMapping_)
+    munmap(symbolPackMapping_, symbolPackSize_);
+}
+
+void SymbolLocations::loadSymbolPack() const
+{
+  const int fd = ::open(symbolPack.c_str(), O_RDONLY);
+  if (fd == -1)
+  {
+    std::cerr << "Can't open symbol pack " << symbolPack << ": " << strerror(errno) << '\n';
+    return;
+  }
+
+  struct stat st;
+  void* mapping = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(SymbolPackHeader))
+    mapping = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+
+  const char* data = static_cast<const char*>(mapping);
+  const SymbolPackHeader* header = static_cast<const SymbolPackHeader*>(mapping);
+  if (mapping == MAP_FAILED || memcmp(header->magic, symbolPackMagic, sizeof(symbolPackMagic)) != 0 ||
+      header->version != symbolPackVersion)
+  {
+    std::cerr << "File " << symbolPack << " is not a symbol pack\n";
+    if (mapping != MAP_FAILED)
+      munmap(mapping, st.st_size);
+    return;
+  }
+  symbolPackMapping_ = mapping;
+  symbolPackSize_ = st.st_size;
+
+  // Index objects by their keys, broken tail of the pack is ignored
+  size_t offset = sizeof(SymbolPackHeader);
+  for (uint32_t i = 0; i < header->objectCount; i++)
+  {
+    if (symbolPackSize_ - offset < sizeof(SymbolPackObject))
+      break;
+    const SymbolPackObject* object = reinterpret_cast<const SymbolPackObject*>(data + offset);
+    if (object->size > symbolPackSize_ - offset || object->size % 8 != 0 || object->size < sizeof(SymbolPackObject) ||
+        object->symbolTableSize > object->size || object->lineCount > object->size / sizeof(SymbolPackLine) ||
+        object->sourceFilesSize > object->size)
+      break;
+    const uint64_t contentsSize = alignTo8(object->keySize) + alignTo8(object->symbolTableSize) +
+                                  object->lineCount * sizeof(SymbolPackLine) + object->sourceFilesSize;
+    if (contentsSize > object->size - sizeof(SymbolPackObject))
+      break;
+
+    const char* key = data + offset + sizeof(SymbolPackObject);
+    symbolPackEntries_.emplace(std::string(key, object->keySize), data + offset);
+    offset += object->size;
   }
+}
+
+const char* SymbolLocations::findSymbolPackEntry(const std::string& key) const
+{
+  if (symbolPack.empty())
+    return nullptr;
+
+  // Pack is mapped once and shared by all resolvers
+  std::call_once(symbolPackLoaded_, &SymbolLocations::loadSymbolPack, this);
+  const auto entryIt = symbolPackEntries_.find(key);
+  return entryIt != symbolPackEntries_.end() ? entryIt->second : nullptr;
+}
+
+AddressResolver::AddressResolver(const ProfileDetails details, const char* fileName, const std::string& recordedBuildId,
+                                 const SymbolLocations& locations)
+: d(new AddressResolverPrivate)
+
+{
+  // Resolvers are created from several threads, libelf has to be initialized only once
+  static const unsigned elfVersion = elf_version(EV_CURRENT);
+  (void)elfVersion;
+
+  d->baseName = basename(fileName);
+
+  // Symbol pack has everything needed, so the file itself may be absent on this host
+  d->packKey = recordedBuildId.empty() ? std::string(fileName) : recordedBuildId;
+  if (loadSymbolPackObject(details, locations))
+    return;
 
-  const Address endAddress = elfh.getEndAddress();
+  // The file could be upgraded or removed since collection, so its copy from the symbol store is preferred
+  const std::string& elfFileName = locations.findExecutable(fileName, recordedBuildId);
+  d->elfFile.reset(new ElfHolder(elfFileName.c_str()));
+  ElfHolder& elfh = *d->elfFile;
+  if (!recordedBuildId.empty() && elfh.get() && elfh.getBuildId() != recordedBuildId)
+  {
+    buildIdMismatch_ = true;
+    elfh.close();
+  }
 
-  elfh.close();
+  const bool haveElfFile = elfh.get() != nullptr;
+  const std::string& buildId = haveElfFile ? elfh.getBuildId() : recordedBuildId;
+  const bool needSymbols = (details != ProfileDetails::Objects);
 
-  d->constructFakeSymbols(details, endAddress, basename(fileName));
+  // Stripped binaries have symbols and debug info in a separate file
+  std::string debugFileName;
+  if (needSymbols && (!elfh.getSection(SymTab) || (details >= ProfileDetails::Sources && !elfh.getSection(DebugInfo))))
+  {
+    std::string debugLink;
+    uint32_t debugLinkCrc = 0;
+    elfh.getDebugLink(debugLink, debugLinkCrc);
+    debugFileName = locations.findDebugFile(fileName, buildId, debugLink, debugLinkCrc);
+    if (!debugFileName.empty())
+      d->debugElfFile.reset(new ElfHolder(debugFileName.c_str()));
+  }
 
-  if (details == ProfileDetails::Sources)
+  // Debug file has the same program headers, that is enough when the binary itself is not available
+  ElfHolder& layoutFile = (haveElfFile || !d->debugElfFile) ? elfh : *d->debugElfFile;
+  d->baseAddress = layoutFile.getBaseAddress();
+  d->endAddress = layoutFile.getEndAddress();
+  usesAbsoluteAddresses_ = layoutFile.usesAbsoluteAddresses();
+
+  // Full symbol table comes from the main file or from the separate debug file, otherwise we use .dynsym
+  ElfHolder* symTabFile = nullptr;
+  if (elfh.getSection(SymTab))
+    symTabFile = &elfh;
+  else if (d->debugElfFile && d->debugElfFile->getSection(SymTab))
+    symTabFile = d->debugElfFile.get();
+
+  // Symbol table doesn't depend on anything but file contents, so it is cached by build-id
+  std::string cacheFileName;
+  if (needSymbols && !locations.cacheDir.empty() && !buildId.empty())
+    cacheFileName = locations.cacheDir + '/' + buildId + ".sym";
+  const bool cacheLoaded = !cacheFileName.empty() && d->loadSymbolCache(cacheFileName, symTabFile != nullptr);
+
+  if (!cacheLoaded)
+  {
+    if (needSymbols && elfh.getSection(PLT) && elfh.getSection(DynSym))
+    {
+      if (elfh.getSection(RelPLT))
+        d->loadPLTSymbols(elfh.get(), elfh.getSection(PLT), elfh.getSection(RelPLT), elfh.getSection(DynSym));
+      if (elfh.getSection(RelAPLT))
+        d->loadPLTSymbols(elfh.get(), elfh.getSection(PLT), elfh.getSection(RelAPLT), elfh.getSection(DynSym));
+    }
+
+    if (needSymbols && symTabFile)
+      d->loadSymbolsFromSection(symTabFile->get(), symTabFile->getSection(SymTab));
+    else if (needSymbols && elfh.getSection(DynSym))
+      d->loadSymbolsFromSection(elfh.get(), elfh.getSection(DynSym));
+
+    d->constructFakeSymbols(details, d->endAddress);
+    // Symbols taken without the binary miss PLT entries, they are not worth caching
+    if (!cacheFileName.empty() && haveElfFile)
+      d->saveSymbolCache(locations.cacheDir, cacheFileName, symTabFile != nullptr);
+  }
+
+  // Files are kept open only while symbol names point into them
+  if (cacheLoaded || !needSymbols)
+  {
+    d->elfFile.reset();
+    d->debugElfFile.reset();
+  }
+
+  if (details >= ProfileDetails::Sources && (haveElfFile || !debugFileName.empty()))
   {
     // Setup dwfl for sources positions fetching
+    const std::string& debugModuleName = debugFileName.empty() ? elfFileName : debugFileName;
     d->dwfl = dwfl_begin(&callbacks);
-    d->dwMod = dwfl_report_offline(d->dwfl, "",debugModuleName.c_str(), -1);
-    dwfl_module_getdwarf(d->dwMod, &d->dwBias);
+    d->dwMod = dwfl_report_offline(d->dwfl, "", debugModuleName.c_str(), -1);
+    d->dwarf = dwfl_module_getdwarf(d->dwMod, &d->dwBias);
   }
 }
 
+AddressResolver::AddressResolver(const ProfileDetails details, const uint32_t pid,
+                                 std::shared_ptr<const JitCode> jitCode, const SymbolLocations& locations)
+: d(new AddressResolverPrivate)
+{
+  // Generated code is addressed as is
+  usesAbsoluteAddresses_ = true;
+  d->baseName = "jit-" + std::to_string(pid);
+  d->packKey = d->baseName;
+  if (loadSymbolPackObject(details, locations))
+    return;
+
+  // Everything is one symbol at object level, mappings are not split into functions
+  d->endAddress = std::numeric_limits<Address>::max();
+  if (details == ProfileDetails::Objects)
+  {
+    d->constructFakeSymbols(details, d->endAddress);
+    return;
+  }
+
+  // Functions don't overlap, gaps are left unresolved. Replaced ones come after the real ranges, in the synthetic area.
+  d->jitCode = std::move(jitCode);
+  d->jitCode->forEachSymbol([&](const Range& range, const char* name) {
+    ARSymbolData symbolData(range.length());
+    symbolData.name = name;
+    d->symbols.push_back(ARSymbol(range, symbolData));
+  });
+}
+
+bool AddressResolver::loadSymbolPackObject(const ProfileDetails details, const SymbolLocations& locations)
+{
+  const char* packEntry = locations.findSymbolPackEntry(d->packKey);
+  if (!packEntry)
+    return false;
+
+  const SymbolPackObject& packObject = *reinterpret_cast<const SymbolPackObject*>(packEntry);
+  usesAbsoluteAddresses_ = packObject.flags & symbolPackAbsoluteAddresses;
+  d->loadSymbolPackObject(details, packObject);
+  return true;
+}
+
 AddressResolver::~AddressResolver()
 {
   if (d->dwfl)
@@ -308,54 +1025,157 @@ std::string AddressResolver::constructSymbolNameFromAddress(Address address)
   return ss.str();
 }
 
-std::pair<std::string, Range> AddressResolver::resolve(const Address address) const
+std::string AddressResolver::fileBuildId(const char* fileName)
+{
+  static const unsigned elfVersion = elf_version(EV_CURRENT);
+  (void)elfVersion;
+
+  ElfHolder elfh(fileName);
+  return elfh.get() ? elfh.getBuildId() : std::string();
+}
+
+void AddressResolver::resolve(const std::vector<Address>& addresses, std::vector<size_t>& symbols) const
 {
-  std::pair<std::string, Range> result;
-  ARSymbolStorage::const_iterator arSymIt = d->symbols.find(Range(address));
-  if (arSymIt == d->symbols.end())
+  symbols.resize(addresses.size());
+
+  // Merge both sorted sequences. Hit addresses are usually sparse comparing to symbols, so the next symbol is
+  // searched by galloping from the current one instead of stepping through every symbol.
+  const ARSymbolStorage& arSymbols = d->symbols;
+  auto symIt = arSymbols.begin();
+  for (size_t i = 0; i < addresses.size(); i++)
   {
+    const Address address = addresses[i];
+    assert(i == 0 || addresses[i - 1] <= address);
+
+    if (symIt != arSymbols.end() && symIt->first.end() <= address)
+    {
+      size_t step = 1;
+      auto boundIt = symIt;
+      while (arSymbols.end() - boundIt > static_cast<ptrdiff_t>(step) && (boundIt + step)->first.end() <= address)
+      {
+        boundIt += step;
+        step *= 2;
+      }
+      const auto searchEnd = arSymbols.end() - boundIt > static_cast<ptrdiff_t>(step) ? boundIt + step + 1 :
+                                                                                        arSymbols.end();
+      symIt = std::lower_bound(boundIt, searchEnd, address, symbolEndsBefore);
+    }
+
+    if (symIt != arSymbols.end() && symIt->first.start() <= address)
+      symbols[i] = symIt - arSymbols.begin();
+    else
+    {
 #ifndef NDEBUG
-    std::cerr << "Can't resolve symbol for address " << std::hex << address << '\n';
+      std::cerr << "Can't resolve symbol for address " << std::hex << address << std::dec << '\n';
 #endif
-
-    return result;
+      symbols[i] = NoSymbol;
+    }
   }
+}
+
+Range AddressResolver::symbolRange(const size_t symbol) const
+{
+  return d->symbols[symbol].first;
+}
+
+const std::string& AddressResolver::symbolName(const size_t symbol) const
+{
+  return d->symbolName(d->symbols[symbol]);
+}
+
+AddressResolverPrivate::~AddressResolverPrivate()
+{
+  if (cacheMapping != MAP_FAILED)
+    munmap(cacheMapping, cacheMappingSize);
+}
+
+const std::string& AddressResolverPrivate::symbolName(const ARSymbol& symbol)
+{
+  // Same symbol is resolved again for every memory object mapping the file
+  auto insResult = materializedNames.emplace(&symbol, std::string());
+  std::string& name = insResult.first->second;
+  if (!insResult.second || !symbol.second.name || !*symbol.second.name)
+    return name;
 
-  result.second = arSymIt->first;
-  const std::string& maybeSymbolName = arSymIt->second.name;
-  if (!maybeSymbolName.empty())
+  if (symbol.second.misc == ARSymbolData::MiscLabel)
+    (name = symbol.second.name).append(1, '@').append(baseName);
+  else
+    name = namesDemangled ? symbol.second.name : demangle(symbol.second.name);
+
+  if (symbol.second.misc == ARSymbolData::MiscPLT)
+    name.append("@plt");
+
+  return name;
+}
+
+void AddressResolver::getSourcePositions(const std::vector<Address>& addresses,
+                                         std::vector<SourcePosition>& positions) const
+{
+  positions.assign(addresses.size(), SourcePosition(nullptr, 0));
+  // Line tables from symbol pack are preloaded
+  if (!d->dwarf && !d->compileUnitsLoaded)
+    return;
+
+  d->loadCompileUnits();
+  const std::vector<ARCompileUnit>& units = d->compileUnits;
+
+  size_t addressIdx = 0;
+  while (addressIdx < addresses.size())
   {
-    char* demangledName = __cxxabiv1::__cxa_demangle(maybeSymbolName.c_str(), 0, 0, 0);
-    if (demangledName)
+    // DWARF addresses match addresses in ELF space
+    const Address address = addresses[addressIdx];
+    assert(addressIdx == 0 || addresses[addressIdx - 1] <= address);
+
+    auto unitIt = std::upper_bound(units.begin(), units.end(), ARCompileUnit{address, 0, 0});
+    if (unitIt == units.begin() || (--unitIt)->end <= address)
     {
-      result.first = demangledName;
-      free(demangledName);
+      addressIdx++;
+      continue;
     }
-    else
-      result.first = maybeSymbolName;
 
-    if (arSymIt->second.misc == ARSymbolData::MiscPLT)
-      result.first.append("@plt");
+    // Walk line table of the unit once for all addresses it covers. Like dwfl_getsrc() we take the last row
+    // starting at or before the address unless it terminates a sequence.
+    const ARLineTable& lines = d->lineTable(unitIt->dieOffset);
+    auto lineIt = lines.begin();
+    for (; addressIdx < addresses.size() && addresses[addressIdx] < unitIt->end; addressIdx++)
+    {
+      lineIt = std::upper_bound(lineIt, lines.end(), addresses[addressIdx],
+                                [](Address address, const ARLine& line) { return address < line.address; });
+      if (lineIt != lines.begin() && !(lineIt - 1)->endSequence)
+        positions[addressIdx] = SourcePosition((lineIt - 1)->sourceFile, (lineIt - 1)->sourceLine);
+    }
   }
-
-  return result;
 }
 
-std::pair<const char*, size_t> AddressResolver::getSourcePosition(Address address) const
+void AddressResolver::getInlinedCalls(const std::vector<Address>& addresses,
+                                      std::vector<const InlinedCalls*>& chains) const
 {
-  if (d->dwfl)
+  chains.assign(addresses.size(), nullptr);
+  if (!d->dwarf)
+    return;
+
+  d->loadCompileUnits();
+  const std::vector<ARCompileUnit>& units = d->compileUnits;
+
+  size_t addressIdx = 0;
+  while (addressIdx < addresses.size())
   {
-    Dwfl_Line* line = dwfl_getsrc(d->dwfl, address + d->dwBias);
-    if (line)
+    const Address address = addresses[addressIdx];
+    auto unitIt = std::upper_bound(units.begin(), units.end(), ARCompileUnit{address, 0, 0});
+    if (unitIt == units.begin() || (--unitIt)->end <= address)
     {
-      int linep = 0;
-      const char* srcFile =
-        dwfl_lineinfo(line, nullptr /*addr*/, &linep, nullptr /*colp*/, nullptr /*mtime*/, nullptr /*length*/);
-      return std::make_pair(srcFile, linep);
+      addressIdx++;
+      continue;
     }
-  }
 
-  return std::make_pair(static_cast<const char*>(0), 0);
+    const ARInlineTable& table = d->inlineTable(unitIt->dieOffset);
+    for (; addressIdx < addresses.size() && addresses[addressIdx] < unitIt->end; addressIdx++)
+    {
+      auto rangeIt = table.upper_bound(addresses[addressIdx]);
+      if (rangeIt != table.begin())
+        chains[addressIdx] = (--rangeIt)->second;
+    }
+  }
 }
 
 void AddressResolverPrivate::loadPLTSymbols(Elf* elf, Elf_Scn *pltSection, Elf_Scn *relPltSection, Elf_Scn *dynsymSection)
@@ -395,7 +1215,8 @@ void AddressResolverPrivate::loadPLTSymbols(Elf* elf, Elf_Scn *pltSection, Elf_S
     GElf_Sym elfSymbol;
     gelf_getsym(dynsymData, symIdx, &elfSymbol);
 
-    ARSymbolData& symbolData = symbols.insert(ARSymbol(Range(symStart, symStart + symSize), ARSymbolData(symSize))).first->second;
+    ARSymbolData& symbolData = loadedSymbols.insert(ARSymbol(Range(symStart, symStart + symSize), ARSymbolData(symSize))).first->second;
+    // Names are stored as pointers into the string table, which stays loaded while resolver exists
     symbolData.name = elf_strptr(elf, strtabIdx, elfSymbol.st_name);
     symbolData.misc = ARSymbolData::MiscPLT;
 
@@ -407,7 +1228,7 @@ void AddressResolverPrivate::loadPLTSymbols(Elf* elf, Elf_Scn *pltSection, Elf_S
 
 void AddressResolverPrivate::loadSymbolsFromSection(Elf* elf, Elf_Scn *section)
 {
-  symbols.erase(symbols.lower_bound(Range(pltEndAddress)), symbols.end());
+  loadedSymbols.erase(loadedSymbols.lower_bound(Range(pltEndAddress)), loadedSymbols.end());
 
   GElf_Shdr sectionHeader;
   gelf_getshdr(section, &sectionHeader);
@@ -424,66 +1245,60 @@ void AddressResolverPrivate::loadSymbolsFromSection(Elf* elf, Elf_Scn *section)
       continue;
 
     ARSymbolData symbolData(elfSymbol);
+    symbolData.name = elf_strptr(elf, sectionHeader.sh_link, elfSymbol.st_name);
     uint64_t symStart = elfSymbol.st_value;
     uint64_t symEnd = symStart + (elfSymbol.st_size ?: 1);
 
-    std::pair<ARSymbolStorage::iterator, bool> insResult =
-        symbols.insert(ARSymbol(Range(symStart, symEnd), symbolData));
-    if (insResult.second)
-      insResult.first->second.name = elf_strptr(elf, sectionHeader.sh_link, elfSymbol.st_name);
-    else
+    std::pair<ARSymbolMap::iterator, bool> insResult =
+        loadedSymbols.insert(ARSymbol(Range(symStart, symEnd), symbolData));
+    if (!insResult.second)
     {
       const ARSymbolData& oldSymbolData = insResult.first->second;
       // Sized functions better that asm labels and higer binding is also better
       if ((oldSymbolData.size == 0 && symbolData.size != 0) || (oldSymbolData.misc < symbolData.misc))
       {
-        symbols.erase(insResult.first);
-        symbolData.name = elf_strptr(elf, sectionHeader.sh_link, elfSymbol.st_name);
-        symbols.insert(ARSymbol(Range(symStart, symEnd), symbolData));
+        loadedSymbols.erase(insResult.first);
+        loadedSymbols.insert(ARSymbol(Range(symStart, symEnd), symbolData));
       }
     }
   }
 }
 
-//const char* AddressResolver::getDebugLink(Elf_Scn* section)
-//{
-//  Elf_Data* sectionData = elf_rawdata(section, 0);
-//  return (char*)sectionData->d_buf;
-//}
-
-void AddressResolverPrivate::constructFakeSymbols(const ProfileDetails details, Address endAddress,
-                                                  const char* baseName)
+void AddressResolverPrivate::constructFakeSymbols(const ProfileDetails details, Address endAddress)
 {
-  // Create fake symbols to cover gaps
+  // Create fake symbols to cover gaps, loaded symbols don't overlap so result is sorted
   ARSymbolStorage newSymbols;
+  newSymbols.reserve(loadedSymbols.size() * 2 + 1);
   uint64_t prevEnd = baseAddress;
-  for (ARSymbolStorage::iterator symIt = symbols.begin(); symIt != symbols.end(); ++symIt)
+  for (ARSymbolMap::iterator symIt = loadedSymbols.begin(); symIt != loadedSymbols.end(); ++symIt)
   {
     const Range& symRange = symIt->first;
     if (symRange.start() - prevEnd >= 4)
-      newSymbols.insert(ARSymbol(Range(prevEnd, symRange.start()), ARSymbolData(symRange.start() - prevEnd)));
+      newSymbols.push_back(ARSymbol(Range(prevEnd, symRange.start()), ARSymbolData(symRange.start() - prevEnd)));
 
     // Expand asm label to next symbol
     if (symIt->second.size == 0)
     {
-      ARSymbolStorage::iterator nextSymIt = symIt;
+      ARSymbolMap::iterator nextSymIt = symIt;
       ++nextSymIt;
       uint64_t newEnd;
-      if (nextSymIt == symbols.end())
+      if (nextSymIt == loadedSymbols.end())
         newEnd = endAddress;
       else
         newEnd = nextSymIt->first.start();
 
+      // Name gets "@object" suffix when resolved
       ARSymbolData newSymbolData(newEnd - symRange.start());
-      newSymbolData.name = symIt->second.name.append(1, '@').append(baseName);
+      newSymbolData.name = symIt->second.name;
+      newSymbolData.misc = ARSymbolData::MiscLabel;
 
-      newSymbols.insert(ARSymbol(Range(symRange.start(), newEnd), newSymbolData));
+      newSymbols.push_back(ARSymbol(Range(symRange.start(), newEnd), newSymbolData));
 
       prevEnd = newEnd;
     }
     else
     {
-      newSymbols.insert(*symIt);
+      newSymbols.push_back(*symIt);
       prevEnd = symRange.end();
     }
   }
@@ -491,9 +1306,398 @@ void AddressResolverPrivate::constructFakeSymbols(const ProfileDetails details,
   {
     ARSymbolData newSymbolData(endAddress - prevEnd);
     if (details == ProfileDetails::Objects)
-      (newSymbolData.name = "whole").append(1, '@').append(baseName);
-    newSymbols.insert(ARSymbol(Range(prevEnd, endAddress), newSymbolData));
+    {
+      // Object level symbols are named "whole@object"
+      newSymbolData.name = "whole";
+      newSymbolData.misc = ARSymbolData::MiscLabel;
+    }
+    newSymbols.push_back(ARSymbol(Range(prevEnd, endAddress), newSymbolData));
   }
 
   symbols.swap(newSymbols);
+  loadedSymbols.clear();
+}
+
+bool AddressResolverPrivate::loadSymbolTable(const char* data, const size_t size, const bool fullSymTabAvailable)
+{
+  if (size < sizeof(SymbolCacheHeader))
+    return false;
+
+  const SymbolCacheHeader* header = reinterpret_cast<const SymbolCacheHeader*>(data);
+  const SymbolCacheRecord* records = reinterpret_cast<const SymbolCacheRecord*>(data + sizeof(SymbolCacheHeader));
+  const size_t recordsSize = header->symbolCount * sizeof(SymbolCacheRecord);
+  const char* names = data + sizeof(SymbolCacheHeader) + recordsSize;
+
+  const bool valid = memcmp(header->magic, symbolCacheMagic, sizeof(symbolCacheMagic)) == 0 &&
+                     header->version == symbolCacheVersion &&
+                     header->symbolCount <= (size - sizeof(SymbolCacheHeader)) / sizeof(SymbolCacheRecord) &&
+                     header->namesSize == size - sizeof(SymbolCacheHeader) - recordsSize &&
+                     (header->namesSize == 0 || names[header->namesSize - 1] == 0) &&
+                     // Rebuild cache when debug symbols were installed after it was made
+                     (!fullSymTabAvailable || (header->flags & symbolCacheFullSymTab));
+  if (!valid)
+    return false;
+
+  // Lookups need sorted non-overlapping symbols, table with any other record is rebuilt
+  for (uint64_t i = 0; i < header->symbolCount; i++)
+    if (records[i].start >= records[i].end || (i && records[i].start < records[i - 1].end))
+      return false;
+
+  symbols.reserve(header->symbolCount);
+  for (uint64_t i = 0; i < header->symbolCount; i++)
+  {
+    const SymbolCacheRecord& record = records[i];
+    ARSymbolData symbolData(record.end - record.start);
+    symbolData.misc = record.misc;
+    if (record.nameOffset != symbolCacheNoName && record.nameOffset < header->namesSize)
+      symbolData.name = names + record.nameOffset;
+    symbols.push_back(ARSymbol(Range(record.start, record.end), symbolData));
+  }
+  namesDemangled = true;
+
+  return true;
+}
+
+bool AddressResolverPrivate::loadSymbolCache(const std::string& cacheFileName, const bool fullSymTabAvailable)
+{
+  const int fd = ::open(cacheFileName.c_str(), O_RDONLY);
+  if (fd == -1)
+    return false;
+
+  struct stat st;
+  void* mapping = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(SymbolCacheHeader))
+    mapping = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED)
+    return false;
+
+  const size_t fileSize = st.st_size;
+  const bool valid = loadSymbolTable(static_cast<const char*>(mapping), fileSize, fullSymTabAvailable);
+  if (valid)
+  {
+    // Names point into the mapping
+    cacheMapping = mapping;
+    cacheMappingSize = fileSize;
+  }
+  else
+    munmap(mapping, fileSize);
+
+  return valid;
+}
+
+void AddressResolverPrivate::saveSymbolCache(const std::string& cacheDir, const std::string& cacheFileName,
+                                             const bool fullSymTab) const
+{
+  std::string symbolTable;
+  appendSymbolTable(symbolTable, symbols, !namesDemangled, fullSymTab);
+
+  if (!makeDirectories(cacheDir))
+    return;
+
+  // Write to a temporary file first, several resolvers may store the same cache concurrently
+  std::string tempFileName = cacheFileName + ".XXXXXX";
+  const int fd = mkstemp(&tempFileName[0]);
+  if (fd == -1)
+    return;
+
+  bool written = write(fd, symbolTable.data(), symbolTable.size()) == static_cast<ssize_t>(symbolTable.size());
+  written = (::close(fd) == 0) && written;
+
+  if (!written || rename(tempFileName.c_str(), cacheFileName.c_str()) != 0)
+    unlink(tempFileName.c_str());
+}
+
+void AddressResolverPrivate::loadSymbolPackObject(const ProfileDetails details, const SymbolPackObject& object)
+{
+  // Object was validated when the pack was indexed, names point into the pack mapping
+  const char* data = reinterpret_cast<const char*>(&object) + sizeof(SymbolPackObject) + alignTo8(object.keySize);
+  baseAddress = object.baseAddress;
+  endAddress = object.endAddress;
+
+  if (details == ProfileDetails::Objects || !loadSymbolTable(data, object.symbolTableSize, false))
+    constructFakeSymbols(details, endAddress);
+  data += alignTo8(object.symbolTableSize);
+
+  // All rows make one line table, they are already sorted
+  compileUnitsLoaded = true;
+  if (details < ProfileDetails::Sources || object.lineCount == 0)
+    return;
+
+  const SymbolPackLine* packLines = reinterpret_cast<const SymbolPackLine*>(data);
+  const char* sourceFiles = data + object.lineCount * sizeof(SymbolPackLine);
+  ARLineTable& lines = lineTables[0];
+  lines.reserve(object.lineCount);
+  for (uint64_t i = 0; i < object.lineCount; i++)
+  {
+    const SymbolPackLine& packLine = packLines[i];
+    ARLine line;
+    line.address = packLine.address;
+    line.sourceFile = packLine.sourceFileOffset < object.sourceFilesSize ? sourceFiles + packLine.sourceFileOffset :
+                                                                           nullptr;
+    line.sourceLine = packLine.sourceLine;
+    line.endSequence = packLine.sourceFileOffset == symbolPackEndSequence;
+    lines.push_back(line);
+  }
+  compileUnits.push_back(ARCompileUnit{lines.front().address, lines.back().address, 0});
+}
+
+std::string AddressResolver::symbolPackEntry(const std::vector<Address>& addresses) const
+{
+  std::vector<size_t> addressSymbols;
+  resolve(addresses, addressSymbols);
+
+  // Sorted addresses give sorted symbols
+  ARSymbolStorage hitSymbols;
+  size_t lastSymbol = NoSymbol;
+  for (const size_t symbol: addressSymbols)
+  {
+    if (symbol != NoSymbol && symbol != lastSymbol)
+      hitSymbols.push_back(d->symbols[symbol]);
+    lastSymbol = symbol;
+  }
+
+  std::string symbolTable;
+  appendSymbolTable(symbolTable, hitSymbols, !d->namesDemangled, true);
+
+  // Rows in effect over every symbol range, each range is terminated so the gaps don't get positions
+  std::vector<SymbolPackLine> packLines;
+  std::string sourceFiles;
+  std::unordered_map<std::string, uint32_t> sourceFileOffsets;
+  if (d->dwarf)
+  {
+    d->loadCompileUnits();
+    const std::vector<ARCompileUnit>& units = d->compileUnits;
+    auto appendLine = [&](const Address address, const ARLine& line) {
+      SymbolPackLine packLine = {address, symbolPackEndSequence, line.sourceLine};
+      if (!line.endSequence && !line.sourceFile)
+        packLine.sourceFileOffset = symbolPackNoSourceFile;
+      else if (!line.endSequence)
+      {
+        const auto insResult = sourceFileOffsets.emplace(line.sourceFile, sourceFiles.size());
+        if (insResult.second)
+          sourceFiles.append(line.sourceFile, strlen(line.sourceFile) + 1);
+        packLine.sourceFileOffset = insResult.first->second;
+      }
+      packLines.push_back(packLine);
+    };
+
+    for (const auto& symbol: hitSymbols)
+    {
+      const Address start = symbol.first.start();
+      auto unitIt = std::upper_bound(units.begin(), units.end(), ARCompileUnit{start, 0, 0});
+      if (unitIt == units.begin() || (--unitIt)->end <= start)
+        continue;
+
+      const Address end = std::min<Address>(symbol.first.end(), unitIt->end);
+      const ARLineTable& lines = d->lineTable(unitIt->dieOffset);
+      auto lineIt = std::upper_bound(lines.begin(), lines.end(), start,
+                                     [](Address address, const ARLine& line) { return address < line.address; });
+      if (lineIt != lines.begin())
+        appendLine(start, *(lineIt - 1));
+      for (; lineIt != lines.end() && lineIt->address < end; ++lineIt)
+        appendLine(lineIt->address, *lineIt);
+      appendLine(end, ARLine{end, nullptr, 0, true});
+    }
+  }
+
+  SymbolPackObject object;
+  object.baseAddress = d->baseAddress;
+  object.endAddress = d->endAddress;
+  object.flags = usesAbsoluteAddresses_ ? symbolPackAbsoluteAddresses : 0;
+  const std::string& key = d->packKey;
+  object.keySize = key.size();
+  object.symbolTableSize = symbolTable.size();
+  object.lineCount = packLines.size();
+  object.sourceFilesSize = sourceFiles.size();
+  object.size = alignTo8(sizeof(object) + alignTo8(key.size()) + alignTo8(symbolTable.size()) +
+                         packLines.size() * sizeof(SymbolPackLine) + sourceFiles.size());
+
+  std::string entry(reinterpret_cast<const char*>(&object), sizeof(object));
+  entry.append(key);
+  entry.resize(alignTo8(entry.size()));
+  entry.append(symbolTable);
+  entry.resize(alignTo8(entry.size()));
+  entry.append(reinterpret_cast<const char*>(packLines.data()), packLines.size() * sizeof(SymbolPackLine));
+  entry.append(sourceFiles);
+  entry.resize(object.size);
+  return entry;
+}
+
+bool AddressResolver::writeSymbolPack(const char* fileName, const std::vector<std::string>& entries)
+{
+  SymbolPackHeader header;
+  memcpy(header.magic, symbolPackMagic, sizeof(symbolPackMagic));
+  header.version = symbolPackVersion;
+  header.objectCount = entries.size();
+
+  std::ofstream out(fileName, std::ios_base::binary);
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (const auto& entry: entries)
+    out.write(entry.data(), entry.size());
+  out.close();
+  return !out.fail();
+}
+
+void AddressResolverPrivate::loadCompileUnits()
+{
+  if (compileUnitsLoaded)
+    return;
+  compileUnitsLoaded = true;
+
+  Dwarf_Aranges* aranges;
+  size_t arangeCount;
+  if (dwarf_getaranges(dwarf, &aranges, &arangeCount) == 0 && arangeCount > 0)
+  {
+    for (size_t i = 0; i < arangeCount; i++)
+    {
+      Dwarf_Addr start;
+      Dwarf_Word length;
+      Dwarf_Off dieOffset;
+      if (dwarf_getarangeinfo(dwarf_onearange(aranges, i), &start, &length, &dieOffset) == 0 && length)
+        compileUnits.push_back(ARCompileUnit{start, start + length, dieOffset});
+    }
+  }
+  else
+  {
+    // No .debug_aranges, so take ranges from compile unit DIEs, their children are not read
+    Dwarf_Off offset = 0, nextOffset;
+    size_t headerSize;
+    while (dwarf_nextcu(dwarf, offset, &nextOffset, &headerSize, 0, 0, 0) == 0)
+    {
+      Dwarf_Die cuDie;
+      if (dwarf_offdie(dwarf, offset + headerSize, &cuDie))
+      {
+        Dwarf_Addr base, start, end;
+        ptrdiff_t rangeOffset = 0;
+        while ((rangeOffset = dwarf_ranges(&cuDie, rangeOffset, &base, &start, &end)) > 0)
+          if (start < end)
+            compileUnits.push_back(ARCompileUnit{start, end, offset + headerSize});
+      }
+      offset = nextOffset;
+    }
+  }
+
+  std::sort(compileUnits.begin(), compileUnits.end());
+}
+
+const ARLineTable& AddressResolverPrivate::lineTable(const Dwarf_Off cuDieOffset)
+{
+  auto insResult = lineTables.emplace(cuDieOffset, ARLineTable());
+  ARLineTable& lines = insResult.first->second;
+  if (!insResult.second)
+    return lines;
+
+  Dwarf_Die cuDie;
+  Dwarf_Lines* dwLines;
+  size_t lineCount;
+  if (!dwarf_offdie(dwarf, cuDieOffset, &cuDie) || dwarf_getsrclines(&cuDie, &dwLines, &lineCount) != 0)
+    return lines;
+
+  lines.reserve(lineCount);
+  for (size_t i = 0; i < lineCount; i++)
+  {
+    Dwarf_Line* dwLine = dwarf_onesrcline(dwLines, i);
+    ARLine line;
+    line.sourceLine = 0;
+    line.endSequence = false;
+    dwarf_lineaddr(dwLine, &line.address);
+    dwarf_lineno(dwLine, &line.sourceLine);
+    dwarf_lineendsequence(dwLine, &line.endSequence);
+    line.sourceFile = dwarf_linesrc(dwLine, 0, 0);
+    lines.push_back(line);
+  }
+
+  // libdw returns rows sorted by address with sequence ends first, keep that order if it is ever different
+  std::stable_sort(lines.begin(), lines.end(), [](const ARLine& lhs, const ARLine& rhs) {
+    return lhs.address < rhs.address || (lhs.address == rhs.address && lhs.endSequence && !rhs.endSequence);
+  });
+
+  return lines;
+}
+
+const ARInlineTable& AddressResolverPrivate::inlineTable(const Dwarf_Off cuDieOffset)
+{
+  auto insResult = inlineTables.emplace(cuDieOffset, ARInlineTable());
+  ARInlineTable& table = insResult.first->second;
+  if (!insResult.second)
+    return table;
+
+  Dwarf_Die cuDie;
+  Dwarf_Files* files = nullptr;
+  size_t fileCount;
+  if (!dwarf_offdie(dwarf, cuDieOffset, &cuDie))
+    return table;
+  if (dwarf_getsrcfiles(&cuDie, &files, &fileCount) != 0)
+    files = nullptr;
+
+  InlinedCalls chain;
+  collectInlinedCalls(&cuDie, files, chain, table);
+  return table;
+}
+
+/// Returns demangled linkage name of the function, or its plain name when there is none
+static std::string functionName(Dwarf_Die* die)
+{
+  Dwarf_Attribute attr;
+  const char* linkageName = nullptr;
+  if (dwarf_attr_integrate(die, DW_AT_linkage_name, &attr) || dwarf_attr_integrate(die, DW_AT_MIPS_linkage_name, &attr))
+    linkageName = dwarf_formstring(&attr);
+  if (linkageName)
+    return demangle(linkageName);
+
+  const char* name = dwarf_diename(die);
+  return name ? name : "???";
+}
+
+void AddressResolverPrivate::collectInlinedCalls(Dwarf_Die* parent, Dwarf_Files* files, InlinedCalls& chain,
+                                                 ARInlineTable& table)
+{
+  // Children are visited after their parent, so ranges of deeper inlined functions overwrite the outer ones
+  Dwarf_Die die;
+  if (dwarf_child(parent, &die) != 0)
+    return;
+
+  do
+  {
+    if (dwarf_tag(&die) != DW_TAG_inlined_subroutine)
+    {
+      collectInlinedCalls(&die, files, chain, table);
+      continue;
+    }
+
+    InlinedCall call{functionName(&die), SourcePosition(nullptr, 0), SourcePosition(nullptr, 0)};
+    int declLine = 0;
+    call.declaration.first = dwarf_decl_file(&die);
+    if (dwarf_decl_line(&die, &declLine) == 0)
+      call.declaration.second = declLine;
+    Dwarf_Attribute attr;
+    Dwarf_Word value;
+    if (files && dwarf_attr_integrate(&die, DW_AT_call_file, &attr) && dwarf_formudata(&attr, &value) == 0)
+      call.call.first = dwarf_filesrc(files, value, 0, 0);
+    if (dwarf_attr_integrate(&die, DW_AT_call_line, &attr) && dwarf_formudata(&attr, &value) == 0)
+      call.call.second = value;
+
+    chain.push_back(std::move(call));
+    inlinedCalls.push_back(chain);
+    const InlinedCalls* calls = &inlinedCalls.back();
+
+    Dwarf_Addr base, start, end;
+    ptrdiff_t rangeOffset = 0;
+    while ((rangeOffset = dwarf_ranges(&die, rangeOffset, &base, &start, &end)) > 0)
+    {
+      if (start >= end)
+        continue;
+
+      // Range after the end keeps whatever covered it before
+      auto endIt = table.upper_bound(end);
+      const InlinedCalls* afterEnd = endIt != table.begin() ? std::prev(endIt)->second : nullptr;
+      table.erase(table.lower_bound(start), endIt);
+      table[start] = calls;
+      table.emplace(end, afterEnd);
+    }
+
+    collectInlinedCalls(&die, files, chain, table);
+    chain.pop_back();
+  } while (dwarf_siblingof(&die, &die) == 0);
 }
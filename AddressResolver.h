@@ -3,38 +3,216 @@
 
 #include "Profile.h"
 
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 #include <stdint.h>
 
 class AddressResolverPrivate;
 
+/// Source file and line, file is null when position is unknown
+typedef std::pair<const char*, size_t> SourcePosition;
+
+/// Function inlined at some address, positions of its declaration and of the inlined call
+struct InlinedCall
+{
+  std::string name;
+  SourcePosition declaration;
+  SourcePosition call;
+};
+
+/// Functions inlined one into another, the outermost one comes first
+typedef std::vector<InlinedCall> InlinedCalls;
+
+/// Places where resolvers look for symbol information besides the mapped file itself
+struct SymbolLocations
+{
+  /// Directory for symbol tables cached by build-id, caching is disabled when it is empty
+  std::string cacheDir;
+  /// Directories with separate debug files searched after /usr/lib/debug, they are indexed on first use
+  std::vector<std::string> debugDirs;
+  /// Symbol store with files of other hosts, @c build-id/executable and @c build-id/debuginfo like debuginfod cache
+  std::string storeDir;
+  /// Symbol pack made by pgarchive, objects found there are resolved without touching their files
+  std::string symbolPack;
+
+  SymbolLocations() = default;
+  ~SymbolLocations();
+
+  /// $XDG_CACHE_HOME/perfgrind or ~/.cache/perfgrind
+  static std::string defaultCacheDir();
+
+  /**
+   * @brief Finds separate debug file by build-id or by .gnu_debuglink
+   * @param fileName File which debug information is looked for
+   * @param buildId Build-id of the file in hex, can be empty
+   * @param debugLink File name from .gnu_debuglink section, can be empty
+   * @param debugLinkCrc CRC32 of the debug file from .gnu_debuglink section
+   * @return Name of the debug file or empty string if nothing was found
+   */
+  std::string findDebugFile(const std::string& fileName, const std::string& buildId, const std::string& debugLink,
+                            uint32_t debugLinkCrc) const;
+
+  /// Returns copy of the file from the symbol store if there is one for @a buildId, otherwise @a fileName
+  std::string findExecutable(const std::string& fileName, const std::string& buildId) const;
+
+  /// Returns entry of the object with build-id or file name @a key in the symbol pack, null if there is none
+  const char* findSymbolPackEntry(const std::string& key) const;
+
+private:
+  void indexDebugDirs() const;
+  void loadSymbolPack() const;
+
+  mutable std::once_flag debugDirsIndexed_;
+  mutable std::unordered_map<std::string, std::string> debugFilesByBuildId_;
+  mutable std::unordered_multimap<std::string, std::string> debugFilesByName_;
+
+  mutable std::once_flag symbolPackLoaded_;
+  mutable void* symbolPackMapping_ = nullptr;
+  mutable size_t symbolPackSize_ = 0;
+  mutable std::unordered_map<std::string, const char*> symbolPackEntries_;
+};
+
+/// Functions generated at runtime by one process, read from /tmp/perf-pid.map and jitdump files
+/** JIT compilers reuse memory of freed code, so the same address belongs to different functions over time. Jitdump
+ *  records are timestamped, code which is replaced later gets its own range in the synthetic area and samples taken
+ *  in it are moved there by their time. Perf map has no timestamps, the latest function placed at the address wins. */
+class JitCode
+{
+public:
+  struct Function
+  {
+    Range range;
+    /// Start of the range the function is known by, it differs from the real one for code replaced later
+    Address placedStart;
+    const char* name;
+  };
+
+  /**
+   * @param pid Process which generated the code
+   * @param jitDumpFiles Jitdump files mapped by the process
+   * @param syntheticStart Start of the area for code replaced later
+   */
+  JitCode(uint32_t pid, const std::vector<std::string>& jitDumpFiles, Address syntheticStart);
+  JitCode(const JitCode&) = delete;
+  JitCode& operator=(const JitCode&) = delete;
+
+  /// Process which generated the code
+  uint32_t pid() const { return pid_; }
+  /// Translates @a address of code executed at @a time into the range of the function placed there at that time
+  Address place(Address address, uint64_t time) const;
+  /// Area taken by code replaced later, it is empty if no code was replaced
+  Address syntheticStart() const { return syntheticStart_; }
+  Address syntheticEnd() const { return syntheticEnd_; }
+
+  /// Calls @a f with real ranges of functions which are there at the end, and with placed ranges of replaced ones
+  template <typename F>
+  void forEachSymbol(F f) const;
+
+private:
+  void loadPerfMap(const std::string& fileName);
+  void loadJitDump(const std::string& fileName);
+  void insert(const Range& range, uint64_t time, const char* name);
+
+  std::deque<std::string> names_;
+  std::deque<Function> functions_;
+  BasicAddressSpace<const Function*> functionSpace_;
+  uint32_t pid_;
+  Address syntheticStart_;
+  Address syntheticEnd_;
+};
+
+template <typename F>
+void JitCode::forEachSymbol(F f) const
+{
+  functionSpace_.forEachLatest([&](const Range& range, const Function* function) { f(range, function->name); });
+  for (const Function& function: functions_)
+    if (function.placedStart != function.range.start())
+      f(function.range.adjusted(function.placedStart - function.range.start()), function.name);
+}
+
 class AddressResolver
 {
 public:
-  AddressResolver(ProfileDetails details, const char* fileName);
+  /**
+   * @param details Detail level which defines what has to be loaded
+   * @param fileName Name of the mapped file
+   * @param buildId Build-id recorded during collection in hex, empty if unknown
+   * @param locations Places where to look for symbols
+   */
+  AddressResolver(ProfileDetails details, const char* fileName, const std::string& buildId,
+                  const SymbolLocations& locations);
+
+  /**
+   * @brief Resolver of code generated at runtime
+   * @param details Detail level which defines what has to be loaded
+   * @param pid Process which generated the code
+   * @param jitCode Functions generated by the process, they are used unless the symbol pack has the process
+   * @param locations Places where to look for symbols, only symbol pack is used
+   */
+  AddressResolver(ProfileDetails details, uint32_t pid, std::shared_ptr<const JitCode> jitCode,
+                  const SymbolLocations& locations);
   ~AddressResolver();
 
+  static constexpr size_t NoSymbol = SIZE_MAX;
+
+  /**
+   * @brief Resolves many addresses in one pass over the symbol table
+   * @param addresses Addresses in ELF space sorted in ascending order
+   * @param symbols Receives index of the symbol covering every address or AddressResolver::NoSymbol
+   */
+  void resolve(const std::vector<Address>& addresses, std::vector<size_t>& symbols) const;
+  Range symbolRange(size_t symbol) const;
+  /// @note Name can be empty, use AddressResolver::constructSymbolNameFromAddress() to construct fake one
+  const std::string& symbolName(size_t symbol) const;
+
+  /**
+   * @brief Finds source positions of many addresses at once
+   * @note Only line tables of compile units covering the addresses are decoded, and each of them is walked once
+   * @param addresses Addresses in ELF space sorted in ascending order
+   * @param positions Receives source position of every address
+   */
+  void getSourcePositions(const std::vector<Address>& addresses, std::vector<SourcePosition>& positions) const;
+
   /**
-   * @brief Resolves address to the symbol
-   * @note Returned symbol name can be empty, use AddressResolver::constructSymbolNameFromAddress() to construct fake
-   * name
-   * @note Resolution failure is reported by returning empty range
-   * @param address An address to resolve in ELF space
-   * @return Symbol name and range of the addresses which is covered by the symbol.
+   * @brief Finds functions inlined at many addresses at once
+   * @note Inlined subroutines are indexed by address ranges only for compile units covering the addresses
+   * @param addresses Addresses in ELF space sorted in ascending order
+   * @param chains Receives inlined functions of every address, null when it is not in inlined code. Chains live as
+   *        long as the resolver.
    */
-  std::pair<std::string, Range> resolve(Address address) const;
-  std::pair<const char*, size_t> getSourcePosition(Address address) const;
+  void getInlinedCalls(const std::vector<Address>& addresses, std::vector<const InlinedCalls*>& chains) const;
 
   bool usesAbsoluteAddresses() const { return usesAbsoluteAddresses_; }
+  /// Build-id of the file found on this host differs from the recorded one, so the file was not used
+  bool buildIdMismatch() const { return buildIdMismatch_; }
+
+  /**
+   * @brief Serializes symbols covering the addresses and line table rows of their ranges for a symbol pack
+   * @note Entry is keyed by build-id of the file, or by its name when there is no build-id
+   * @param addresses Addresses in ELF space sorted in ascending order
+   */
+  std::string symbolPackEntry(const std::vector<Address>& addresses) const;
+  static bool writeSymbolPack(const char* fileName, const std::vector<std::string>& entries);
 
   static std::string constructSymbolNameFromAddress(Address address);
+  /// Returns build-id of ELF file @a fileName, or empty string if it has none or can't be read
+  static std::string fileBuildId(const char* fileName);
 
 private:
   AddressResolver(const AddressResolver&);
   AddressResolver& operator=(const AddressResolver&);
+
+  bool loadSymbolPackObject(ProfileDetails details, const SymbolLocations& locations);
+
   AddressResolverPrivate* d;
 
   bool usesAbsoluteAddresses_ = false;
+  bool buildIdMismatch_ = false;
 };
 
 #endif // ADDRESSRESOLVER_H
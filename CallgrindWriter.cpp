@@ -0,0 +1,425 @@
+#include "CallgrindWriter.h"
+#include "Parallel.h"
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace {
+
+using namespace callgrind;
+
+/// Symbols [firstSymbol, lastSymbol) of one memory object
+struct ChunkPart
+{
+  const MemoryObject* object;
+  SymbolStorage::const_iterator firstSymbol;
+  SymbolStorage::const_iterator lastSymbol;
+};
+
+/// Part of output which is formatted on its own, either several small objects or part of a large one
+typedef std::vector<ChunkPart> Chunk;
+
+/// Cost of a source line, either spent in the line itself or in calls of @a callee made from it
+struct LineCost
+{
+  const std::string* file;
+  size_t line;
+  /// Null for the cost of the line itself
+  const Symbol* callee;
+  Count count;
+
+  bool sameLine(const LineCost& other) const
+  {
+    return file == other.file && line == other.line && callee == other.callee;
+  }
+};
+
+typedef std::vector<const Entry*> EntryList;
+
+/// Formats one chunk of callgrind output, names first used by the chunk are written in full on their first use in it
+class ChunkWriter
+{
+public:
+  ChunkWriter(const Profile& profile, const Names& names, size_t chunkIndex, bool dumpInstructions);
+
+  std::string write(const Chunk& chunk);
+
+private:
+  void writeCallTo(const Symbol* callSymbol);
+  void writeEntriesWithoutInstructions(const std::string* fileName, const EntryList& entries);
+  void writeEntriesWithInstructions(const MemoryObject& currentObject, const std::string* fileName,
+                                    const EntryList& entries);
+  bool writeFunctionEntries(const MemoryObject& object, const std::string* fileName, const EntryList& entries,
+                            size_t depth);
+
+  OutputBuffer out_;
+  NameWriter names_;
+  const MemoryObjectStorage& objects_;
+  const bool dumpInstructions_;
+  // Called symbol is described by the same lines at every call, they are made once
+  std::unordered_map<const Symbol*, std::string> callTo_;
+  // Reused by every symbol, so grouping doesn't allocate once it has grown
+  std::vector<LineCost> lineCosts_;
+};
+
+ChunkWriter::ChunkWriter(const Profile& profile, const Names& names, const size_t chunkIndex,
+                         const bool dumpInstructions)
+: names_(out_, names, chunkIndex)
+, objects_(profile.memoryObjects())
+, dumpInstructions_(dumpInstructions)
+{
+}
+
+void ChunkWriter::writeCallTo(const Symbol* callSymbol)
+{
+  const auto callToIt = callTo_.find(callSymbol);
+  if (callToIt != callTo_.end())
+  {
+    out_ << callToIt->second;
+    return;
+  }
+
+  // Names may be written in full only once, so the lines are kept with ids only
+  const MemoryObjectData& callObjectData = objects_.at(Range(callSymbol->first.start()));
+  const size_t objectId = names_.write("cob=", Objects, callObjectData.fileName());
+  const size_t fileId = names_.write("cfi=", Files, callSymbol->second.sourceFile());
+  const size_t functionId = names_.write("cfn=", Functions, callSymbol->second.name());
+  callTo_.emplace(callSymbol, "cob=(" + std::to_string(objectId) + ")\ncfi=(" + std::to_string(fileId) + ")\ncfn=(" +
+                                  std::to_string(functionId) + ")\n");
+}
+
+void ChunkWriter::writeEntriesWithoutInstructions(const std::string* fileName, const EntryList& entries)
+{
+  lineCosts_.clear();
+  for (const Entry* entry: entries)
+  {
+    const EntryData& entryData = entry->second;
+    if (entryData.count())
+      lineCosts_.push_back(LineCost{&entryData.sourceFile(), entryData.sourceLine(), nullptr, entryData.count()});
+    for (const auto& branch: entryData.branches())
+      lineCosts_.push_back(LineCost{&entryData.sourceFile(), entryData.sourceLine(), branch.first.symbol,
+                                    branch.second});
+  }
+
+  // We want to dump summary for current file first, cost of the line itself goes before its calls. Files and callees
+  // are ordered by name and address, their pointers depend on timing of threads which resolved them.
+  std::sort(lineCosts_.begin(), lineCosts_.end(), [fileName](const LineCost& left, const LineCost& right) {
+    if (left.file != right.file)
+    {
+      if (left.file == fileName || right.file == fileName)
+        return left.file == fileName;
+      return *left.file < *right.file;
+    }
+    const Address leftCallee = left.callee ? left.callee->first.start() : 0;
+    const Address rightCallee = right.callee ? right.callee->first.start() : 0;
+    return std::tie(left.line, leftCallee) < std::tie(right.line, rightCallee);
+  });
+
+  // Same lines are summed in place
+  size_t lineCount = 0;
+  for (size_t i = 0; i < lineCosts_.size(); ++i)
+  {
+    if (lineCount && lineCosts_[lineCount - 1].sameLine(lineCosts_[i]))
+      lineCosts_[lineCount - 1].count += lineCosts_[i].count;
+    else
+      lineCosts_[lineCount++] = lineCosts_[i];
+  }
+  lineCosts_.resize(lineCount);
+
+  for (const LineCost& lineCost: lineCosts_)
+  {
+    if (lineCost.file != fileName)
+    {
+      fileName = lineCost.file;
+      names_.write("fi=", Files, *fileName);
+    }
+
+    if (!lineCost.callee)
+    {
+      out_ << lineCost.line << ' ' << lineCost.count << '\n';
+      continue;
+    }
+
+    writeCallTo(lineCost.callee);
+    out_ << "calls=1 " << lineCost.callee->second.sourceLine() << '\n';
+    out_ << lineCost.line << ' ' << lineCost.count << '\n';
+  }
+}
+
+void ChunkWriter::writeEntriesWithInstructions(const MemoryObject& currentObject, const std::string* fileName,
+                                                   const EntryList& entries)
+{
+  for (const Entry* entry: entries)
+  {
+    Address entryAddress = currentObject.second.mapToElf(currentObject.first.start(), entry->first);
+    const EntryData& entryData = entry->second;
+
+    if (fileName != &entryData.sourceFile())
+    {
+      fileName = &entryData.sourceFile();
+      names_.write("fi=", Files, *fileName);
+    }
+
+    if (entryData.count())
+    {
+      out_.hex(entryAddress);
+      out_ << ' ' << entryData.sourceLine() << ' ' << entryData.count() << '\n';
+    }
+
+    for (const Branch* branch: entryData.callsByAddress())
+    {
+      const Symbol* callSymbol = branch->first.symbol;
+      const MemoryObject& callObject = *objects_.find(Range(callSymbol->first.start()));
+      Address callAddress = callObject.second.mapToElf(callObject.first.start(), callSymbol->first.start());
+      writeCallTo(callSymbol);
+      out_ << "calls=1 ";
+      out_.hex(callAddress);
+      out_ << ' ' << callSymbol->second.sourceLine() << '\n';
+      out_.hex(entryAddress);
+      out_ << ' ' << entryData.sourceLine() << ' ' << branch->second << '\n';
+    }
+  }
+}
+
+/// Writes entries of the function at @a depth of their inline chains
+/** Functions inlined into it are written as calls followed by their own blocks. Returns true if such blocks were
+ *  written. */
+bool ChunkWriter::writeFunctionEntries(const MemoryObject& object, const std::string* fileName,
+                                           const EntryList& entries, const size_t depth)
+{
+  // Same function can be inlined several times, calls from different positions are kept apart
+  typedef std::tuple<const std::string*, size_t, std::string> InlinedCallKey;
+  std::map<InlinedCallKey, EntryList> inlinedCalls;
+  EntryList selfEntries;
+  for (const Entry* entry: entries)
+  {
+    const InlineChain* chain = entry->second.inlineChain();
+    if (!chain || chain->size() <= depth)
+    {
+      selfEntries.push_back(entry);
+      continue;
+    }
+    const InlineFrame& frame = (*chain)[depth];
+    inlinedCalls[InlinedCallKey(frame.callFile, frame.callLine, frame.name)].push_back(entry);
+  }
+
+  if (dumpInstructions_)
+    writeEntriesWithInstructions(object, fileName, selfEntries);
+  else
+    writeEntriesWithoutInstructions(fileName, selfEntries);
+
+  // Inlined function costs everything sampled inside it, including calls it makes
+  for (const auto& inlinedCall: inlinedCalls)
+  {
+    const InlineFrame& frame = (*inlinedCall.second.front()->second.inlineChain())[depth];
+    Count inclusive = 0;
+    for (const Entry* entry: inlinedCall.second)
+    {
+      inclusive += entry->second.count();
+      for (const auto& branch: entry->second.branches())
+        inclusive += branch.second;
+    }
+
+    names_.write("fi=", Files, *frame.callFile);
+    names_.write("cob=", Objects, object.second.fileName());
+    names_.write("cfi=", Files, *frame.declFile);
+    names_.write("cfn=", Functions, frame.name);
+    if (dumpInstructions_)
+    {
+      const Address callAddress = object.second.mapToElf(object.first.start(), inlinedCall.second.front()->first);
+      out_ << "calls=1 ";
+      out_.hex(callAddress);
+      out_ << ' ' << frame.declLine << '\n';
+      out_.hex(callAddress);
+      out_ << ' ' << frame.callLine << ' ' << inclusive << '\n';
+    }
+    else
+    {
+      out_ << "calls=1 " << frame.declLine << '\n';
+      out_ << frame.callLine << ' ' << inclusive << '\n';
+    }
+  }
+
+  for (const auto& inlinedCall: inlinedCalls)
+  {
+    const InlineFrame& frame = (*inlinedCall.second.front()->second.inlineChain())[depth];
+    names_.write("fl=", Files, *frame.declFile);
+    names_.write("fn=", Functions, frame.name);
+    writeFunctionEntries(object, frame.declFile, inlinedCall.second, depth + 1);
+  }
+
+  return !inlinedCalls.empty();
+}
+
+std::string ChunkWriter::write(const Chunk& chunk)
+{
+  EntryList symbolEntries;
+  for (const ChunkPart& part: chunk)
+  {
+    const MemoryObject& object = *part.object;
+    const EntryStorage& entries = object.second.entries();
+    const SymbolStorage& symbols = object.second.symbols();
+
+    if (part.firstSymbol == symbols.begin())
+      names_.write("ob=", Objects, object.second.fileName());
+
+    const std::string* fileName = 0;
+
+    for (auto symbolIt = part.firstSymbol; symbolIt != part.lastSymbol; ++symbolIt)
+    {
+      const Range& symbolRange = symbolIt->first;
+      const SymbolData& symbolData = symbolIt->second;
+
+      if (!fileName || fileName != &symbolData.sourceFile())
+      {
+        fileName = &symbolData.sourceFile();
+        names_.write("fl=", Files, *fileName);
+      }
+      names_.write("fn=", Functions, symbolData.name());
+
+      symbolEntries.clear();
+      const auto entryLast = entries.upper_bound(symbolRange.end());
+      for (auto entryIt = entries.lower_bound(symbolRange.start()); entryIt != entryLast; ++entryIt)
+        symbolEntries.push_back(&*entryIt);
+
+      // Blocks of inlined functions change the file, so it is repeated for the next symbol
+      if (writeFunctionEntries(object, fileName, symbolEntries, 0))
+        fileName = 0;
+    }
+
+    if (part.lastSymbol == symbols.end())
+      out_ << '\n';
+  }
+
+  return std::move(out_.data());
+}
+
+/// Number of entries after which the chunk is closed, even in the middle of a memory object
+constexpr size_t ChunkEntries = 1 << 16;
+
+/// Splits output into chunks and assigns ids to all names written in them
+/** Every name written by the chunk is noted, so the first chunk which uses a name is known. */
+static void planChunks(const Profile& profile, const bool dumpInstructions, std::vector<Chunk>& chunks,
+                       Names& names)
+{
+  const MemoryObjectStorage& objects = profile.memoryObjects();
+  // Only the first use matters, so chains and called symbols are looked at once
+  std::unordered_set<const InlineChain*> inlineChains;
+  std::unordered_set<const Symbol*> callSymbols;
+  size_t chunkEntries = 0;
+  chunks.emplace_back();
+  for (const auto& object: objects)
+  {
+    names.insert(Objects, object.second.fileName(), chunks.size() - 1);
+
+    const EntryStorage& entries = object.second.entries();
+    const SymbolStorage& symbols = object.second.symbols();
+    ChunkPart part{&object, symbols.begin(), symbols.begin()};
+    for (auto symbolIt = symbols.begin(); symbolIt != symbols.end(); ++symbolIt)
+    {
+      const size_t chunk = chunks.size() - 1;
+      names.insert(Files, symbolIt->second.sourceFile(), chunk);
+      names.insert(Functions, symbolIt->second.name(), chunk);
+
+      const std::string* fileName = &symbolIt->second.sourceFile();
+      const auto entryLast = entries.upper_bound(symbolIt->first.end());
+      for (auto entryIt = entries.lower_bound(symbolIt->first.start()); entryIt != entryLast; ++entryIt)
+      {
+        ++chunkEntries;
+        const EntryData& entryData = entryIt->second;
+        // Without instructions entries with no cost at all are not written
+        const bool written = dumpInstructions || entryData.count() || !entryData.branches().empty();
+        if (written && fileName != &entryData.sourceFile())
+        {
+          fileName = &entryData.sourceFile();
+          names.insert(Files, *fileName, chunk);
+        }
+        if (entryData.inlineChain() && inlineChains.insert(entryData.inlineChain()).second)
+        {
+          for (const InlineFrame& frame: *entryData.inlineChain())
+          {
+            names.insert(Files, *frame.declFile, chunk);
+            names.insert(Files, *frame.callFile, chunk);
+            names.insert(Functions, frame.name, chunk);
+          }
+        }
+        for (const Branch* branch: entryData.callsByAddress())
+        {
+          const Symbol* callSymbol = branch->first.symbol;
+          if (!callSymbols.insert(callSymbol).second)
+            continue;
+          names.insert(Objects, objects.at(Range(callSymbol->first.start())).fileName(), chunk);
+          names.insert(Files, callSymbol->second.sourceFile(), chunk);
+          names.insert(Functions, callSymbol->second.name(), chunk);
+        }
+      }
+
+      part.lastSymbol = std::next(symbolIt);
+      if (chunkEntries >= ChunkEntries)
+      {
+        chunks.back().push_back(part);
+        chunks.emplace_back();
+        part.firstSymbol = part.lastSymbol;
+        chunkEntries = 0;
+      }
+    }
+    // Part without symbols still ends the object
+    chunks.back().push_back(part);
+  }
+}
+
+} // namespace
+
+namespace callgrind
+{
+
+NameWriter::NameWriter(OutputBuffer& out, const Names& names, const size_t chunk)
+: out_(out)
+, names_(names)
+, chunk_(chunk)
+{
+  for (int nameSpace = 0; nameSpace < NameSpaceCount; ++nameSpace)
+    definedNames_[nameSpace].resize(names.size(NameSpace(nameSpace)) + 1);
+}
+
+size_t NameWriter::write(const char* key, const NameSpace nameSpace, const std::string& name)
+{
+  const size_t id = names_.id(nameSpace, name);
+  out_ << key << '(' << id << ')';
+  if (!definedNames_[nameSpace][id] && names_.definedBy(nameSpace, name, chunk_))
+  {
+    definedNames_[nameSpace][id] = true;
+    out_ << ' ' << name;
+  }
+  out_ << '\n';
+  return id;
+}
+
+} // namespace callgrind
+
+bool writeCallgrind(std::ostream& os, const Profile& profile, const bool dumpInstructions, const unsigned jobs)
+{
+  os << "positions:";
+  if (dumpInstructions)
+    os << " instr";
+  os << " line\n";
+
+  os << "events: Cycles\n\n";
+
+  std::vector<Chunk> chunks;
+  Names names;
+  planChunks(profile, dumpInstructions, chunks, names);
+
+  parallelOrdered<std::string>(chunks.size(), jobs,
+                               [&](size_t i) {
+                                 return ChunkWriter(profile, names, i, dumpInstructions).write(chunks[i]);
+                               },
+                               [&](const std::string& data) { os.write(data.data(), data.size()); });
+  return bool(os);
+}
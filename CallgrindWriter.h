@@ -0,0 +1,136 @@
+#pragma once
+
+#include "Profile.h"
+
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <cstring>
+
+/// Writes the resolved @a profile in callgrind format, with instruction addresses if @a dumpInstructions is set
+/** Output is split into chunks of memory objects or their symbols which are formatted by @a jobs threads (zero means
+ *  all CPUs) and written in order, each with one call. Object, file and function names are referred by ids, a name is
+ *  written in full on its first use in the output only. Returns false if writing failed. */
+bool writeCallgrind(std::ostream& os, const Profile& profile, bool dumpInstructions, unsigned jobs = 0);
+
+/// Parts of callgrind output shared by all writers of the format
+namespace callgrind
+{
+
+/// Collects formatted output in memory, so it can be written with one call
+class OutputBuffer
+{
+public:
+  OutputBuffer& operator<<(const char value)
+  {
+    data_ += value;
+    return *this;
+  }
+
+  OutputBuffer& operator<<(const std::string& value)
+  {
+    data_ += value;
+    return *this;
+  }
+
+  OutputBuffer& operator<<(const char* value)
+  {
+    data_.append(value, strlen(value));
+    return *this;
+  }
+
+  OutputBuffer& operator<<(uint64_t value)
+  {
+    char digits[20];
+    char* first = digits + sizeof(digits);
+    do
+    {
+      *--first = '0' + value % 10;
+      value /= 10;
+    }
+    while (value);
+    data_.append(first, digits + sizeof(digits) - first);
+    return *this;
+  }
+
+  /// Appends @a value as hexadecimal number with 0x prefix
+  void hex(uint64_t value)
+  {
+    static const char hexDigits[] = "0123456789abcdef";
+    char digits[18];
+    char* first = digits + sizeof(digits);
+    do
+    {
+      *--first = hexDigits[value & 0xf];
+      value >>= 4;
+    }
+    while (value);
+    *--first = 'x';
+    *--first = '0';
+    data_.append(first, digits + sizeof(digits) - first);
+  }
+
+  std::string& data() { return data_; }
+
+private:
+  std::string data_;
+};
+
+/// Callgrind name spaces, ids of names are shared by all keys of the same space
+enum NameSpace
+{
+  Objects,
+  Files,
+  Functions,
+  NameSpaceCount
+};
+
+/// Ids of all names which can be written, they are assigned before writing so every chunk of output uses the same ones
+/** Every name is written in full by the first chunk which uses it only, later chunks refer to it by id. Output written
+ *  at once is one chunk. */
+class Names
+{
+public:
+  /// Notes use of @a name by @a chunk, chunks are planned in order so the first use is kept
+  void insert(const NameSpace nameSpace, const std::string& name, const size_t chunk)
+  {
+    names_[nameSpace].emplace(name, Name{names_[nameSpace].size() + 1, chunk});
+  }
+
+  size_t id(const NameSpace nameSpace, const std::string& name) const { return names_[nameSpace].at(name).id; }
+  /// Returns true if @a chunk is the first one which uses @a name
+  bool definedBy(const NameSpace nameSpace, const std::string& name, const size_t chunk) const
+  {
+    return names_[nameSpace].at(name).firstChunk == chunk;
+  }
+  /// Number of ids in @a nameSpace, ids start from one
+  size_t size(const NameSpace nameSpace) const { return names_[nameSpace].size(); }
+
+private:
+  struct Name
+  {
+    size_t id;
+    size_t firstChunk;
+  };
+
+  std::unordered_map<std::string, Name> names_[NameSpaceCount];
+};
+
+/// Writes names of one chunk of output compressed to their ids
+class NameWriter
+{
+public:
+  NameWriter(OutputBuffer& out, const Names& names, size_t chunk);
+
+  /// Writes line of @a key and @a name compressed to its id, the name itself is written on its first use in output
+  size_t write(const char* key, NameSpace nameSpace, const std::string& name);
+
+private:
+  OutputBuffer& out_;
+  const Names& names_;
+  const size_t chunk_;
+  std::vector<bool> definedNames_[NameSpaceCount];
+};
+
+} // namespace callgrind
@@ -0,0 +1,63 @@
+#include "CommandLine.h"
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+
+uint32_t parseIdArgument(const char* value)
+{
+  char* endptr;
+  const unsigned long id = strtoul(value, &endptr, 10);
+  if (*endptr != 0 || endptr == value || id > UINT32_MAX)
+  {
+    std::cerr << "Invalid process or thread id '" << value << "'\n";
+    exit(EXIT_FAILURE);
+  }
+  return id;
+}
+
+ResolveOptions::ResolveOptions()
+{
+  symbolLocations.cacheDir = SymbolLocations::defaultCacheDir();
+}
+
+bool ResolveOptions::parseOption(const int opt, const char* value)
+{
+  switch (opt)
+  {
+  case 'm':
+    if (strcmp(value, "flat") == 0)
+      mode = ProfileMode::Flat;
+    else if (strcmp(value, "callgraph") == 0)
+      mode = ProfileMode::CallGraph;
+    else
+    {
+      std::cerr << "Invalid mode '" << value << "'\n";
+      exit(EXIT_FAILURE);
+    }
+    return true;
+  case 'j': {
+    char* endptr;
+    jobs = strtoul(value, &endptr, 10);
+    if (*endptr != 0 || jobs == 0)
+    {
+      std::cerr << "Invalid number of jobs '" << value << "'\n";
+      exit(EXIT_FAILURE);
+    }
+    return true;
+  }
+  case 'c':
+    symbolLocations.cacheDir = value;
+    return true;
+  case 's':
+    symbolLocations.debugDirs.push_back(value);
+    return true;
+  case 'S':
+    symbolLocations.storeDir = value;
+    return true;
+  case 'a':
+    symbolLocations.symbolPack = value;
+    return true;
+  }
+  return false;
+}
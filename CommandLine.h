@@ -0,0 +1,25 @@
+#pragma once
+
+#include "Profile.h"
+#include "AddressResolver.h"
+
+#include <cstdint>
+
+// Arguments shared by the command line tools, invalid values are reported and the program exits
+
+/// Parses process or thread id given to --include-pid or --exclude-pid
+uint32_t parseIdArgument(const char* value);
+
+/// Options of tools which load and resolve profiles: -m mode, -j jobs, -c cachedir, -s debugdir, -S storedir and
+/// -a symbolpack
+struct ResolveOptions
+{
+  ResolveOptions();
+
+  /// Applies option @a opt with @a value, returns false if it is not one of the above
+  bool parseOption(int opt, const char* value);
+
+  ProfileMode mode = ProfileMode::CallGraph;
+  unsigned jobs = 0;
+  SymbolLocations symbolLocations;
+};
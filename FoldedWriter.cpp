@@ -0,0 +1,198 @@
+#include "FoldedWriter.h"
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+/// Stacks of frame names, contexts which differ only by addresses inside the same frames share one stack
+class FoldedStacks
+{
+public:
+  using StackId = uint32_t;
+  static constexpr StackId Root = 0;
+
+  FoldedStacks(const Profile& profile, ProfileDetails details);
+
+  /// Returns stack made of @a parent and frames of @a address
+  StackId append(StackId parent, Address address);
+  void addCount(StackId stack, Count count) { stacks_[stack].count += count; }
+  void write(std::ostream& os) const;
+
+private:
+  struct Stack
+  {
+    StackId parent;
+    uint32_t name;
+    Count count;
+  };
+
+  void nameFrames(Address address, std::vector<std::string>& names) const;
+  uint32_t internName(std::string& name);
+
+  const MemoryObjectStorage& objects_;
+  const ProfileDetails details_;
+  std::vector<Stack> stacks_;
+  // Stack by its parent in the high half and the last frame name in the low one
+  std::unordered_map<uint64_t, StackId> children_;
+  std::vector<std::string> names_;
+  std::unordered_map<std::string, uint32_t> nameIds_;
+  // Call sites are shared by many contexts, so names of every address are found once
+  std::unordered_map<Address, std::vector<uint32_t>> frameNames_;
+};
+
+constexpr FoldedStacks::StackId FoldedStacks::Root;
+
+FoldedStacks::FoldedStacks(const Profile& profile, const ProfileDetails details)
+: objects_(profile.memoryObjects())
+, details_(details)
+{
+  stacks_.push_back(Stack{Root, 0, 0});
+  names_.emplace_back();
+}
+
+static std::string withPosition(const std::string& name, const std::string& sourceFile, const size_t sourceLine)
+{
+  return name + " (" + sourceFile + ':' + std::to_string(sourceLine) + ')';
+}
+
+void FoldedStacks::nameFrames(const Address address, std::vector<std::string>& names) const
+{
+  if (address == CallTree::TruncatedFrame)
+  {
+    names.push_back("[truncated]");
+    return;
+  }
+
+  const auto objectIt = objects_.find(Range(address));
+  if (objectIt == objects_.end())
+  {
+    names.push_back("[unknown]");
+    return;
+  }
+
+  const MemoryObjectData& objectData = objectIt->second;
+  const auto symbolIt = objectData.symbols().find(Range(address));
+  if (details_ == ProfileDetails::Objects || symbolIt == objectData.symbols().end())
+  {
+    names.push_back(details_ == ProfileDetails::Objects ? objectData.fileName() : '[' + objectData.fileName() + ']');
+    return;
+  }
+
+  const std::string& symbolName = symbolIt->second.name();
+  const auto entryIt = objectData.entries().find(address);
+  if (details_ == ProfileDetails::Symbols || entryIt == objectData.entries().end())
+  {
+    names.push_back(symbolName);
+    return;
+  }
+
+  // Every function of inline chain is shown with the position of the next inlined call in it
+  const EntryData& entryData = entryIt->second;
+  const InlineChain* chain = entryData.inlineChain();
+  if (!chain)
+  {
+    names.push_back(withPosition(symbolName, entryData.sourceFile(), entryData.sourceLine()));
+    return;
+  }
+  names.push_back(withPosition(symbolName, *chain->front().callFile, chain->front().callLine));
+  for (size_t i = 0; i < chain->size(); ++i)
+  {
+    if (i + 1 < chain->size())
+      names.push_back(withPosition((*chain)[i].name, *(*chain)[i + 1].callFile, (*chain)[i + 1].callLine));
+    else
+      names.push_back(withPosition((*chain)[i].name, entryData.sourceFile(), entryData.sourceLine()));
+  }
+}
+
+uint32_t FoldedStacks::internName(std::string& name)
+{
+  // Semicolon separates frames
+  std::replace(name.begin(), name.end(), ';', ':');
+  const auto insResult = nameIds_.emplace(name, names_.size());
+  if (insResult.second)
+    names_.push_back(std::move(name));
+  return insResult.first->second;
+}
+
+FoldedStacks::StackId FoldedStacks::append(StackId parent, const Address address)
+{
+  auto frameNamesIt = frameNames_.find(address);
+  if (frameNamesIt == frameNames_.end())
+  {
+    std::vector<std::string> names;
+    nameFrames(address, names);
+    std::vector<uint32_t> nameIds;
+    for (std::string& name: names)
+      nameIds.push_back(internName(name));
+    frameNamesIt = frameNames_.emplace(address, std::move(nameIds)).first;
+  }
+
+  for (const uint32_t name: frameNamesIt->second)
+  {
+    // Calls inside the same object make no sense at object level
+    if (details_ == ProfileDetails::Objects && parent != Root && stacks_[parent].name == name)
+      continue;
+
+    const uint64_t key = (uint64_t(parent) << 32) | name;
+    const auto insResult = children_.emplace(key, stacks_.size());
+    if (insResult.second)
+      stacks_.push_back(Stack{parent, name, 0});
+    parent = insResult.first->second;
+  }
+  return parent;
+}
+
+void FoldedStacks::write(std::ostream& os) const
+{
+  std::vector<StackId> path;
+  for (StackId stack = 1; stack < stacks_.size(); ++stack)
+  {
+    if (!stacks_[stack].count)
+      continue;
+
+    path.clear();
+    for (StackId frame = stack; frame != Root; frame = stacks_[frame].parent)
+      path.push_back(frame);
+
+    for (auto frameIt = path.rbegin(); frameIt != path.rend(); ++frameIt)
+    {
+      if (frameIt != path.rbegin())
+        os << ';';
+      os << names_[stacks_[*frameIt].name];
+    }
+    os << ' ' << stacks_[stack].count << '\n';
+  }
+}
+
+} // namespace
+
+bool writeFolded(std::ostream& os, const Profile& profile, const ProfileDetails details)
+{
+  FoldedStacks stacks(profile, details);
+
+  const auto& nodes = profile.callTree().nodes();
+  if (nodes.size() > 1)
+  {
+    // Parents come first, so stacks of their contexts are always known
+    std::vector<FoldedStacks::StackId> nodeStacks(nodes.size(), FoldedStacks::Root);
+    for (CallTree::NodeId node = 1; node < nodes.size(); ++node)
+    {
+      nodeStacks[node] = stacks.append(nodeStacks[nodes[node].parent], nodes[node].address);
+      stacks.addCount(nodeStacks[node], nodes[node].count);
+    }
+  }
+  else
+  {
+    // No callchains in flat mode, every sampled entry is a stack on its own
+    for (const auto& object: profile.memoryObjects())
+      for (const auto& entry: object.second.entries())
+        if (entry.second.count())
+          stacks.addCount(stacks.append(FoldedStacks::Root, entry.first), entry.second.count());
+  }
+
+  stacks.write(os);
+  return bool(os);
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "Profile.h"
+
+#include <ostream>
+
+/// Writes calling contexts of the resolved @a profile as folded stacks used by flame graph tools
+/** Every unique stack is written once as "outer;...;inner count". Frames are named according to @a details: object
+ *  file, symbol, symbol with source position, or the symbol followed by functions inlined into it. Contexts of the
+ *  call tree are merged into a tree of frame names, so whole stacks are never stored. Profile loaded in flat mode
+ *  gives one frame stacks. Returns false if writing failed. */
+bool writeFolded(std::ostream& os, const Profile& profile, ProfileDetails details);
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Number of worker threads used when nothing was requested explicitly
+inline unsigned defaultJobCount()
+{
+  const unsigned hardwareThreads = std::thread::hardware_concurrency();
+  return hardwareThreads ? hardwareThreads : 1;
+}
+
+/// Calls @a function for every index in [0, count) using up to @a jobs threads
+/** Indexes are handed out one by one, so long tasks don't stall the short ones. The calling thread takes part in the
+ *  work as well. Zero @a jobs means \ref defaultJobCount. */
+template <typename Function>
+void parallelFor(const size_t count, unsigned jobs, Function function)
+{
+  if (jobs == 0)
+    jobs = defaultJobCount();
+  if (jobs > count)
+    jobs = count;
+
+  if (jobs <= 1)
+  {
+    for (size_t i = 0; i < count; ++i)
+      function(i);
+    return;
+  }
+
+  std::atomic<size_t> nextIndex(0);
+  auto worker = [&]() {
+    for (size_t i = nextIndex++; i < count; i = nextIndex++)
+      function(i);
+  };
+
+  std::vector<std::thread> threads;
+  threads.reserve(jobs - 1);
+  for (unsigned i = 1; i < jobs; ++i)
+    threads.emplace_back(worker);
+  worker();
+
+  for (auto& thread: threads)
+    thread.join();
+}
+
+/// Calls @a produce for every index in [0, count) using up to @a jobs threads and @a consume for its results in order
+/** Results are consumed by one thread at a time as soon as all earlier ones are done. At most twice as many results
+ *  as there are jobs are made ahead of the consumed ones, later indexes wait, so memory used for results is bounded.
+ *  Zero @a jobs means \ref defaultJobCount. */
+template <typename Result, typename Produce, typename Consume>
+void parallelOrdered(const size_t count, unsigned jobs, Produce produce, Consume consume)
+{
+  if (jobs == 0)
+    jobs = defaultJobCount();
+  const size_t window = 2 * size_t(jobs);
+
+  std::mutex mutex;
+  std::condition_variable consumed;
+  std::vector<Result> results(count);
+  std::vector<bool> ready(count, false);
+  size_t nextToConsume = 0;
+  bool consuming = false;
+
+  parallelFor(count, jobs, [&](size_t i) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      consumed.wait(lock, [&]() { return i < nextToConsume + window; });
+    }
+    Result result = produce(i);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    results[i] = std::move(result);
+    ready[i] = true;
+    if (consuming)
+      return;
+
+    // Results finished by others while this one was consumed are taken as well
+    consuming = true;
+    while (nextToConsume < count && ready[nextToConsume])
+    {
+      Result current = std::move(results[nextToConsume]);
+      lock.unlock();
+      consume(current);
+      lock.lock();
+      ++nextToConsume;
+      consumed.notify_all();
+    }
+    consuming = false;
+  });
+}
@@ -0,0 +1,403 @@
+#include "PprofWriter.h"
+
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <zlib.h>
+
+namespace {
+
+/// Field numbers of profile.proto messages
+enum ProfileField
+{
+  ProfileSampleType = 1,
+  ProfileSample = 2,
+  ProfileMapping = 3,
+  ProfileLocation = 4,
+  ProfileFunction = 5,
+  ProfileStringTable = 6,
+  ProfileDefaultSampleType = 14
+};
+
+enum ValueTypeField
+{
+  ValueTypeType = 1,
+  ValueTypeUnit = 2
+};
+
+enum SampleField
+{
+  SampleLocationId = 1,
+  SampleValue = 2
+};
+
+enum MappingField
+{
+  MappingId = 1,
+  MappingMemoryStart = 2,
+  MappingMemoryLimit = 3,
+  MappingFileOffset = 4,
+  MappingFilename = 5,
+  MappingBuildId = 6,
+  MappingHasFunctions = 7,
+  MappingHasFilenames = 8,
+  MappingHasLineNumbers = 9,
+  MappingHasInlineFrames = 10
+};
+
+enum LocationField
+{
+  LocationId = 1,
+  LocationMappingId = 2,
+  LocationAddress = 3,
+  LocationLine = 4
+};
+
+enum LineField
+{
+  LineFunctionId = 1,
+  LineLine = 2
+};
+
+enum FunctionField
+{
+  FunctionId = 1,
+  FunctionName = 2,
+  FunctionSystemName = 3,
+  FunctionFilename = 4,
+  FunctionStartLine = 5
+};
+
+/// Protocol buffers encoding of one message
+class ProtoMessage
+{
+public:
+  void varint(const uint32_t field, const uint64_t value)
+  {
+    tag(field, 0);
+    appendVarint(value);
+  }
+
+  void bytes(const uint32_t field, const std::string& value)
+  {
+    tag(field, 2);
+    appendVarint(value.size());
+    data_ += value;
+  }
+
+  void message(const uint32_t field, const ProtoMessage& value) { bytes(field, value.data_); }
+
+  void packed(const uint32_t field, const std::vector<uint64_t>& values)
+  {
+    ProtoMessage packedValues;
+    for (const uint64_t value: values)
+      packedValues.appendVarint(value);
+    bytes(field, packedValues.data_);
+  }
+
+  const std::string& data() const { return data_; }
+
+private:
+  void tag(const uint32_t field, const unsigned wireType) { appendVarint((uint64_t(field) << 3) | wireType); }
+
+  void appendVarint(uint64_t value)
+  {
+    while (value >= 0x80)
+    {
+      data_ += char(value | 0x80);
+      value >>= 7;
+    }
+    data_ += char(value);
+  }
+
+  std::string data_;
+};
+
+/// Compresses data into gzip stream as it comes
+class GzipWriter
+{
+public:
+  explicit GzipWriter(std::ostream& os)
+  : os_(os)
+  {
+    stream_.zalloc = Z_NULL;
+    stream_.zfree = Z_NULL;
+    stream_.opaque = Z_NULL;
+    // 16 added to window bits asks for gzip header instead of zlib one
+    ok_ = deflateInit2(&stream_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+  }
+
+  ~GzipWriter()
+  {
+    if (ok_)
+      deflateEnd(&stream_);
+  }
+
+  GzipWriter(const GzipWriter&) = delete;
+  GzipWriter& operator=(const GzipWriter&) = delete;
+
+  void write(const std::string& data)
+  {
+    stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    stream_.avail_in = data.size();
+    deflateAll(Z_NO_FLUSH);
+  }
+
+  bool finish()
+  {
+    stream_.next_in = Z_NULL;
+    stream_.avail_in = 0;
+    deflateAll(Z_FINISH);
+    return ok_ && os_;
+  }
+
+private:
+  void deflateAll(const int flush)
+  {
+    char buffer[65536];
+    while (ok_)
+    {
+      stream_.next_out = reinterpret_cast<Bytef*>(buffer);
+      stream_.avail_out = sizeof(buffer);
+      const int result = deflate(&stream_, flush);
+      if (result == Z_STREAM_ERROR)
+        ok_ = false;
+      os_.write(buffer, sizeof(buffer) - stream_.avail_out);
+      if (result == Z_STREAM_END || (stream_.avail_out != 0 && stream_.avail_in == 0))
+        break;
+    }
+  }
+
+  std::ostream& os_;
+  z_stream stream_;
+  bool ok_;
+};
+
+/// Makes profile message field by field, locations and functions are written when they are met first
+class PprofBuilder
+{
+public:
+  PprofBuilder(std::ostream& os, const Profile& profile, ProfileDetails details);
+
+  void writeHeader();
+  void writeMappings();
+  /// Writes sample with @a count and addresses of @a frames, the innermost frame first
+  void writeSample(const std::vector<Address>& frames, Count count);
+  bool finish();
+
+private:
+  uint64_t stringId(const std::string& value);
+  uint64_t functionId(const std::string& name, const std::string* sourceFile, size_t startLine);
+  uint64_t locationId(Address address);
+  void writeField(uint32_t field, const ProtoMessage& message);
+
+  GzipWriter gzip_;
+  const MemoryObjectStorage& objects_;
+  const ProfileDetails details_;
+
+  std::vector<const std::string*> strings_;
+  std::unordered_map<std::string, uint64_t> stringIds_;
+  std::unordered_map<const MemoryObjectData*, uint64_t> mappingIds_;
+  std::map<std::pair<std::string, const std::string*>, uint64_t> functionIds_;
+  std::unordered_map<Address, uint64_t> locationIds_;
+};
+
+PprofBuilder::PprofBuilder(std::ostream& os, const Profile& profile, const ProfileDetails details)
+: gzip_(os)
+, objects_(profile.memoryObjects())
+, details_(details)
+{
+  // First string has to be empty
+  stringId(std::string());
+}
+
+void PprofBuilder::writeField(const uint32_t field, const ProtoMessage& message)
+{
+  ProtoMessage wrapper;
+  wrapper.message(field, message);
+  gzip_.write(wrapper.data());
+}
+
+uint64_t PprofBuilder::stringId(const std::string& value)
+{
+  const auto insResult = stringIds_.emplace(value, strings_.size());
+  if (insResult.second)
+    strings_.push_back(&insResult.first->first);
+  return insResult.first->second;
+}
+
+void PprofBuilder::writeHeader()
+{
+  ProtoMessage sampleType;
+  sampleType.varint(ValueTypeType, stringId("samples"));
+  sampleType.varint(ValueTypeUnit, stringId("count"));
+  writeField(ProfileSampleType, sampleType);
+
+  ProtoMessage defaultSampleType;
+  defaultSampleType.varint(ProfileDefaultSampleType, stringId("samples"));
+  gzip_.write(defaultSampleType.data());
+}
+
+void PprofBuilder::writeMappings()
+{
+  for (const auto& object: objects_)
+  {
+    const uint64_t id = mappingIds_.size() + 1;
+    mappingIds_.emplace(&object.second, id);
+
+    ProtoMessage mapping;
+    mapping.varint(MappingId, id);
+    mapping.varint(MappingMemoryStart, object.second.realAddress(object.first.start()));
+    mapping.varint(MappingMemoryLimit, object.second.realAddress(object.first.end()));
+    mapping.varint(MappingFileOffset, object.second.pageOffset());
+    mapping.varint(MappingFilename, stringId(object.second.fileName()));
+    if (!object.second.buildId().empty())
+      mapping.varint(MappingBuildId, stringId(object.second.buildId()));
+    mapping.varint(MappingHasFunctions, details_ != ProfileDetails::Objects);
+    mapping.varint(MappingHasFilenames, details_ >= ProfileDetails::Sources);
+    mapping.varint(MappingHasLineNumbers, details_ >= ProfileDetails::Sources);
+    mapping.varint(MappingHasInlineFrames, details_ == ProfileDetails::Inlines);
+    writeField(ProfileMapping, mapping);
+  }
+}
+
+uint64_t PprofBuilder::functionId(const std::string& name, const std::string* sourceFile, const size_t startLine)
+{
+  const auto insResult = functionIds_.emplace(std::make_pair(name, sourceFile), functionIds_.size() + 1);
+  if (!insResult.second)
+    return insResult.first->second;
+
+  ProtoMessage function;
+  function.varint(FunctionId, insResult.first->second);
+  function.varint(FunctionName, stringId(name));
+  function.varint(FunctionSystemName, stringId(name));
+  if (sourceFile)
+    function.varint(FunctionFilename, stringId(*sourceFile));
+  function.varint(FunctionStartLine, startLine);
+  writeField(ProfileFunction, function);
+
+  return insResult.first->second;
+}
+
+uint64_t PprofBuilder::locationId(const Address address)
+{
+  const auto insResult = locationIds_.emplace(address, locationIds_.size() + 1);
+  if (!insResult.second)
+    return insResult.first->second;
+
+  ProtoMessage location;
+  location.varint(LocationId, insResult.first->second);
+
+  // Lines go from the innermost inlined function to the symbol itself
+  std::vector<std::pair<uint64_t, size_t>> lines;
+  const auto objectIt = objects_.find(Range(address));
+  if (objectIt == objects_.end())
+  {
+    location.varint(LocationAddress, address);
+    if (address == CallTree::TruncatedFrame)
+      lines.emplace_back(functionId("[truncated]", nullptr, 0), 0);
+  }
+  else
+  {
+    // Addresses are the ones of the process, as memory ranges of mappings are
+    const MemoryObjectData& objectData = objectIt->second;
+    location.varint(LocationMappingId, mappingIds_.at(&objectData));
+    location.varint(LocationAddress, objectData.realAddress(address));
+
+    const auto symbolIt = objectData.symbols().find(Range(address));
+    const auto entryIt = objectData.entries().find(address);
+    const EntryData* entryData = entryIt != objectData.entries().end() ? &entryIt->second : nullptr;
+    if (details_ == ProfileDetails::Objects)
+      lines.emplace_back(functionId(objectData.fileName(), nullptr, 0), 0);
+    else if (symbolIt != objectData.symbols().end())
+    {
+      const SymbolData& symbolData = symbolIt->second;
+      size_t line = entryData && details_ >= ProfileDetails::Sources ? entryData->sourceLine() : 0;
+      const InlineChain* chain = entryData ? entryData->inlineChain() : nullptr;
+      if (chain)
+      {
+        for (auto frameIt = chain->rbegin(); frameIt != chain->rend(); ++frameIt)
+        {
+          lines.emplace_back(functionId(frameIt->name, frameIt->declFile, frameIt->declLine), line);
+          line = frameIt->callLine;
+        }
+      }
+      const std::string* sourceFile = details_ >= ProfileDetails::Sources ? &symbolData.sourceFile() : nullptr;
+      lines.emplace_back(functionId(symbolData.name(), sourceFile, symbolData.sourceLine()), line);
+    }
+  }
+
+  for (const auto& line: lines)
+  {
+    ProtoMessage lineMessage;
+    lineMessage.varint(LineFunctionId, line.first);
+    lineMessage.varint(LineLine, line.second);
+    location.message(LocationLine, lineMessage);
+  }
+  writeField(ProfileLocation, location);
+
+  return insResult.first->second;
+}
+
+void PprofBuilder::writeSample(const std::vector<Address>& frames, const Count count)
+{
+  std::vector<uint64_t> locations;
+  locations.reserve(frames.size());
+  for (const Address address: frames)
+    locations.push_back(locationId(address));
+
+  ProtoMessage sample;
+  sample.packed(SampleLocationId, locations);
+  sample.packed(SampleValue, std::vector<uint64_t>(1, count));
+  writeField(ProfileSample, sample);
+}
+
+bool PprofBuilder::finish()
+{
+  // String table is complete only now, order of fields doesn't matter
+  for (const std::string* value: strings_)
+  {
+    ProtoMessage string;
+    string.bytes(ProfileStringTable, *value);
+    gzip_.write(string.data());
+  }
+  return gzip_.finish();
+}
+
+} // namespace
+
+bool writePprof(std::ostream& os, const Profile& profile, const ProfileDetails details)
+{
+  PprofBuilder builder(os, profile, details);
+  builder.writeHeader();
+  builder.writeMappings();
+
+  std::vector<Address> frames;
+  const auto& nodes = profile.callTree().nodes();
+  if (nodes.size() > 1)
+  {
+    for (CallTree::NodeId node = 1; node < nodes.size(); ++node)
+    {
+      if (!nodes[node].count)
+        continue;
+
+      frames.clear();
+      for (CallTree::NodeId frame = node; frame != CallTree::Root; frame = nodes[frame].parent)
+        frames.push_back(nodes[frame].address);
+      builder.writeSample(frames, nodes[node].count);
+    }
+  }
+  else
+  {
+    // No callchains in flat mode, every sampled entry is a sample on its own
+    for (const auto& object: profile.memoryObjects())
+      for (const auto& entry: object.second.entries())
+        if (entry.second.count())
+          builder.writeSample(std::vector<Address>(1, entry.first), entry.second.count());
+  }
+
+  return builder.finish();
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "Profile.h"
+
+#include <ostream>
+
+/// Writes the resolved @a profile as gzip compressed pprof profile.proto
+/** Every calling context with samples becomes one sample, locations are made of entry addresses and functions of
+ *  symbols (and functions inlined into them) according to @a details. Memory objects become mappings. Messages are
+ *  compressed as soon as they are made, only the tables used for deduplication stay in memory. Returns false if
+ *  compression failed. */
+bool writePprof(std::ostream& os, const Profile& profile, ProfileDetails details);
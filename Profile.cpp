@@ -1,20 +1,24 @@
 #include "Profile.h"
 
 #include "AddressResolver.h"
+#include "Parallel.h"
+#include "pgdata.h"
 
 #include <algorithm>
 #include <climits>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <tuple>
 #include <vector>
 
 #include <linux/perf_event.h>
-
-#ifndef PERF_MAX_STACK_DEPTH
-#define PERF_MAX_STACK_DEPTH 127
-#endif
-
-#ifndef NDEBUG
-#include <iostream>
-#endif
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 static const std::string unknownFile("???");
 
@@ -31,25 +35,32 @@ struct mmap_event
   char fileName[PATH_MAX];
 };
 
-/// Data about sample event
-/** We have enabled only PERF_SAMPLE_IP and PERF_SAMPLE_CALLCHAIN in \ref createPerfEvent in \ref pgcollect.c,
- *  so we define only this small subset of fields. */
-struct sample_event
+/// Fields of sample event we use
+/** Layout of the event depends on sample type, see \ref decodeSample. */
+struct Sample
 {
-  __u64   ip;
-  __u64   callchainSize;
-  __u64   callchain[PERF_MAX_STACK_DEPTH];
+  __u64 ip = 0;
+  __u32 pid = 0;
+  __u32 tid = 0;
+  __u64 time = 0;
+  __u64 callchainSize = 0;
+  const __u64* callchain = nullptr;
 };
 
+/// Buffer large enough for any event, header.size is 16 bits wide
 struct perf_event
 {
   struct perf_event_header header;
   union {
     mmap_event mmap;
-    sample_event sample;
+    __u64 data[(USHRT_MAX + 1 - sizeof(perf_event_header)) / sizeof(__u64)];
   };
+
+  const __u64* end() const { return reinterpret_cast<const __u64*>(reinterpret_cast<const char*>(this) + header.size); }
 };
 
+static_assert(sizeof(pg_build_id_event) + PATH_MAX <= sizeof(perf_event), "Build-id record doesn't fit into buffer");
+
 std::istream& operator>>(std::istream& is, perf_event& event)
 {
   is.read((char*)&event, sizeof(perf_event_header));
@@ -57,6 +68,55 @@ std::istream& operator>>(std::istream& is, perf_event& event)
   return is;
 }
 
+/// Decodes sample event written with @a sampleType, returns false for malformed or unsupported events
+static bool decodeSample(const perf_event& event, const uint64_t sampleType, Sample& sample)
+{
+  const __u64* field = event.data;
+  const __u64* const end = event.end();
+
+  // Fields follow in the order of PERF_SAMPLE_* bits, the ones we don't need are skipped
+  const uint64_t beforeIp = PERF_SAMPLE_IDENTIFIER;
+  const uint64_t beforeCallchain = PERF_SAMPLE_ADDR | PERF_SAMPLE_ID | PERF_SAMPLE_STREAM_ID | PERF_SAMPLE_CPU |
+                                   PERF_SAMPLE_PERIOD;
+  const size_t fixedFields = __builtin_popcountll(sampleType & (beforeIp | PERF_SAMPLE_IP | PERF_SAMPLE_TID |
+                                                                PERF_SAMPLE_TIME | beforeCallchain));
+  if (size_t(end - field) < fixedFields)
+    return false;
+
+  field += __builtin_popcountll(sampleType & beforeIp);
+  if (sampleType & PERF_SAMPLE_IP)
+    sample.ip = *field++;
+  if (sampleType & PERF_SAMPLE_TID)
+  {
+    const __u32* ids = reinterpret_cast<const __u32*>(field++);
+    sample.pid = ids[0];
+    sample.tid = ids[1];
+  }
+  if (sampleType & PERF_SAMPLE_TIME)
+    sample.time = *field++;
+  field += __builtin_popcountll(sampleType & beforeCallchain);
+
+  // Size of read values depends on read_format which is not recorded, pgcollect never asks for them
+  if (sampleType & PERF_SAMPLE_READ)
+    return false;
+
+  if (sampleType & PERF_SAMPLE_CALLCHAIN)
+  {
+    if (field == end)
+      return false;
+    const __u64 callchainSize = *field++;
+    sample.callchainSize = std::min<__u64>(callchainSize, end - field);
+    sample.callchain = field;
+  }
+  return true;
+}
+
+}
+
+/// Memory objects are tracked over time only when every event has a timestamp, otherwise order of events is used
+static bool hasTimestamps(const uint64_t sampleType, const bool sampleIdAll)
+{
+  return sampleIdAll && (sampleType & PERF_SAMPLE_TIME);
 }
 
 std::ostream& operator<<(std::ostream& os, const Range& range)
@@ -78,12 +138,30 @@ SymbolData::SymbolData(std::string name, const std::string* sourceFile, size_t s
 , sourceLine_(sourceLine)
 {}
 
+const std::string* StringTable::insert(const char* value)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return &(*strings_.insert(value).first);
+}
+
 EntryData::EntryData(Count count)
 : count_(count)
 , sourceFile_(&unknownFile)
 , sourceLine_(0)
 {}
 
+std::vector<const Branch*> EntryData::callsByAddress() const
+{
+  std::vector<const Branch*> calls;
+  calls.reserve(branches_.size());
+  for (const Branch& branch: branches_)
+    calls.push_back(&branch);
+  std::sort(calls.begin(), calls.end(), [](const Branch* lhs, const Branch* rhs) {
+    return lhs->first.symbol->first.start() < rhs->first.symbol->first.start();
+  });
+  return calls;
+}
+
 EntryData& MemoryObjectData::appendEntry(Address address, Count count)
 {
   auto& entryData =
@@ -99,57 +177,189 @@ void MemoryObjectData::appendBranch(Address from, Address to)
   appendEntry(from, 0).branches_[to]++;
 }
 
+static bool matchesAnyPattern(const std::vector<std::string>& patterns, const std::string& value)
+{
+  for (const std::string& pattern: patterns)
+    if (fnmatch(pattern.c_str(), value.c_str(), 0) == 0)
+      return true;
+  return false;
+}
+
+bool ProfileFilter::keepsObject(const std::string& fileName) const
+{
+  return (includeObjects.empty() || matchesAnyPattern(includeObjects, fileName)) &&
+         !matchesAnyPattern(excludeObjects, fileName);
+}
+
+static bool matchesAnyRegex(const std::vector<std::regex>& regexes, const std::string& value)
+{
+  for (const std::regex& regex: regexes)
+    if (std::regex_search(value, regex))
+      return true;
+  return false;
+}
+
+bool ProfileFilter::keepsSymbol(const std::string& name) const
+{
+  return (includeSymbols.empty() || matchesAnyRegex(includeSymbols, name)) && !matchesAnyRegex(excludeSymbols, name);
+}
+
+static bool containsId(const std::vector<uint32_t>& ids, const uint32_t pid, const uint32_t tid)
+{
+  return std::find(ids.begin(), ids.end(), pid) != ids.end() || std::find(ids.begin(), ids.end(), tid) != ids.end();
+}
+
+bool ProfileFilter::keepsThread(const uint32_t pid, const uint32_t tid) const
+{
+  return (includeIds.empty() || containsId(includeIds, pid, tid)) && !containsId(excludeIds, pid, tid);
+}
+
+std::string MemoryObjectData::symbolName(const AddressResolver& resolver, const Address startAddress,
+                                         const size_t symbol) const
+{
+  const std::string& resolvedName = resolver.symbolName(symbol);
+  if (!resolvedName.empty())
+    return resolvedName;
+  return AddressResolver::constructSymbolNameFromAddress(mapFromElf(startAddress, resolver.symbolRange(symbol).start()));
+}
+
 void MemoryObjectData::resolveEntries(const AddressResolver& resolver, const Address startAddress,
-                                      StringTable* sourceFiles)
+                                      StringTable* sourceFiles, const bool resolveInlines, const ProfileFilter& filter,
+                                      std::vector<Address>& filteredAddresses)
 {
   // Save whether we use absolute addresses for this memory object
   usesAbsoluteAddresses_ = resolver.usesAbsoluteAddresses();
 
-  // Perform resolving
+  // Neighbour entries mostly come from the same source file, remember the last one to avoid locking the shared table
+  const char* lastSourceFileName = nullptr;
+  const std::string* lastSourceFile = nullptr;
+  auto internSourceFile = [&](const char* name) {
+    if (name != lastSourceFileName)
+    {
+      lastSourceFileName = name;
+      lastSourceFile = sourceFiles->insert(name);
+    }
+    return lastSourceFile;
+  };
+
+  // Entries are sorted, so all of them are resolved in one pass over the symbol table
+  std::vector<Address> elfAddresses;
+  elfAddresses.reserve(entries_.size());
+  for (const auto& entry: entries_)
+    elfAddresses.push_back(mapToElf(startAddress, entry.first));
+
+  std::vector<size_t> entrySymbols;
+  resolver.resolve(elfAddresses, entrySymbols);
+
+  // Symbols come sorted as well, filter decision is remembered for the last one
+  size_t lastSymbol = AddressResolver::NoSymbol;
+  bool lastSymbolKept = false;
+  auto isKept = [&](const size_t symbol) {
+    if (symbol == AddressResolver::NoSymbol)
+      return false;
+    if (!filter.filtersSymbols())
+      return true;
+    if (symbol != lastSymbol)
+    {
+      lastSymbol = symbol;
+      lastSymbolKept = filter.keepsSymbol(symbolName(resolver, startAddress, symbol));
+    }
+    return lastSymbolKept;
+  };
+
+  // Drop unresolved and filtered entries and collect symbols having hits
+  std::vector<size_t> hitSymbols;
+  std::vector<Address> symbolElfAddresses;
+  size_t resolvedIdx = 0;
   EntryStorage::iterator entryIt = entries_.begin();
-  while (entryIt != entries_.end())
+  for (size_t entryIdx = 0; entryIdx < elfAddresses.size(); entryIdx++)
   {
-    Range symbolRange;
-    const auto& resolveResult = resolver.resolve(mapToElf(startAddress, entryIt->first));
-    if (!resolveResult.second.isEmpty())
+    const size_t symbol = entrySymbols[entryIdx];
+    if (!isKept(symbol))
     {
-      symbolRange = Range(mapFromElf(startAddress, resolveResult.second.start()),
-                          mapFromElf(startAddress, resolveResult.second.end()));
-      auto symbolName = !resolveResult.first.empty() ?
-                          resolveResult.first :
-                          AddressResolver::constructSymbolNameFromAddress(symbolRange.start());
+      // Unresolved entries still show their object in calling contexts
+      if (symbol != AddressResolver::NoSymbol)
+        filteredAddresses.push_back(entryIt->first);
+      entryIt = entries_.erase(entryIt);
+      continue;
+    }
 
-      const auto pos = sourceFiles ? resolver.getSourcePosition(resolveResult.second.start()) :
-                                     std::pair<const char*, size_t>{nullptr, 0};
-      if (pos.first)
-      {
-        const auto* sourceFile = &(*sourceFiles->insert(pos.first).first);
-        symbols_.emplace(std::piecewise_construct, std::forward_as_tuple(symbolRange),
-                         std::forward_as_tuple(std::move(symbolName), sourceFile, pos.second));
-      }
-      else
-        symbols_.emplace(symbolRange, std::move(symbolName));
+    if (hitSymbols.empty() || hitSymbols.back() != symbol)
+    {
+      hitSymbols.push_back(symbol);
+      symbolElfAddresses.push_back(resolver.symbolRange(symbol).start());
+    }
+    elfAddresses[resolvedIdx++] = elfAddresses[entryIdx];
+    ++entryIt;
+  }
+  elfAddresses.resize(resolvedIdx);
+
+  // Source positions are looked up in batches as well
+  std::vector<SourcePosition> symbolPositions(hitSymbols.size(), SourcePosition(nullptr, 0));
+  std::vector<SourcePosition> entryPositions(elfAddresses.size(), SourcePosition(nullptr, 0));
+  if (sourceFiles)
+  {
+    resolver.getSourcePositions(symbolElfAddresses, symbolPositions);
+    resolver.getSourcePositions(elfAddresses, entryPositions);
+  }
+
+  for (size_t symbolIdx = 0; symbolIdx < hitSymbols.size(); symbolIdx++)
+  {
+    const Range elfSymbolRange = resolver.symbolRange(hitSymbols[symbolIdx]);
+    const Range symbolRange(mapFromElf(startAddress, elfSymbolRange.start()),
+                            mapFromElf(startAddress, elfSymbolRange.end()));
+    auto name = symbolName(resolver, startAddress, hitSymbols[symbolIdx]);
+
+    const SourcePosition& pos = symbolPositions[symbolIdx];
+    if (pos.first)
+    {
+      const auto* sourceFile = internSourceFile(pos.first);
+      symbols_.emplace_hint(symbols_.end(), std::piecewise_construct, std::forward_as_tuple(symbolRange),
+                            std::forward_as_tuple(std::move(name), sourceFile, pos.second));
     }
     else
+      symbols_.emplace_hint(symbols_.end(), symbolRange, std::move(name));
+  }
+
+  size_t entryIdx = 0;
+  for (auto& entry: entries_)
+  {
+    const SourcePosition& pos = entryPositions[entryIdx++];
+    if (pos.first)
     {
-      entryIt = entries_.erase(entryIt);
-      continue;
+      entry.second.sourceFile_ = internSourceFile(pos.first);
+      entry.second.sourceLine_ = pos.second;
     }
+  }
+
+  if (!resolveInlines)
+    return;
 
-    do
+  // Neighbour entries mostly share the chain, it is converted once
+  std::vector<const InlinedCalls*> entryInlinedCalls;
+  resolver.getInlinedCalls(elfAddresses, entryInlinedCalls);
+  std::unordered_map<const InlinedCalls*, const InlineChain*> chains;
+  auto internPosition = [&](const SourcePosition& pos) {
+    return pos.first ? internSourceFile(pos.first) : &unknownFile;
+  };
+  entryIdx = 0;
+  for (auto& entry: entries_)
+  {
+    const InlinedCalls* inlinedCalls = entryInlinedCalls[entryIdx++];
+    if (!inlinedCalls)
+      continue;
+
+    const InlineChain*& chain = chains[inlinedCalls];
+    if (!chain)
     {
-      if (sourceFiles)
-      {
-        const std::pair<const char*, size_t>& pos = resolver.getSourcePosition(mapToElf(startAddress, entryIt->first));
-        if (pos.first)
-        {
-          entryIt->second.sourceFile_ = &(*sourceFiles->insert(pos.first).first);
-          entryIt->second.sourceLine_ = pos.second;
-        }
-      }
-      ++entryIt;
+      inlineChains_.emplace_back();
+      for (const InlinedCall& call: *inlinedCalls)
+        inlineChains_.back().push_back(InlineFrame{call.name, internPosition(call.declaration),
+                                                   call.declaration.second, internPosition(call.call),
+                                                   call.call.second});
+      chain = &inlineChains_.back();
     }
-    while (entryIt != entries_.end() && entryIt->first < symbolRange.end());
+    entry.second.inlineChain_ = chain;
   }
 }
 
@@ -158,6 +368,11 @@ void MemoryObjectData::fixupBranches(const MemoryObjectStorage& objects)
   // Fixup branches
   // Call "to" address should point to first address of called function,
   // this will allow group them as well
+  // Entries and branch targets are sorted, so symbols found for the previous ones are checked first
+  auto selfSymIt = symbols_.cbegin();
+  const MemoryObjectData* callObjectData = nullptr;
+  SymbolStorage::const_iterator callSymbolIt;
+
   EntryStorage::iterator entryIt = entries_.begin();
   while (entryIt != entries_.end())
   {
@@ -169,19 +384,27 @@ void MemoryObjectData::fixupBranches(const MemoryObjectStorage& objects)
     }
 
     // Must exist, we drop unresolved entries earlier
-    const auto selfSymIt = symbols().find(Range(entryIt->first));
+    while (selfSymIt->first.end() <= entryIt->first)
+      ++selfSymIt;
 
     EntryData fixedEntry(entryData.count());
     for (const auto& branch: entryData.branches())
     {
       const Address& branchAddress = branch.first.address;
-      const MemoryObjectData& callObjectData = objects.at(Range(branchAddress));
-      const auto callSymbolIt = callObjectData.symbols().find(Range(branchAddress));
-      if (callSymbolIt != callObjectData.symbols().end())
+      if (!callObjectData || branchAddress < callSymbolIt->first.start() ||
+          branchAddress >= callSymbolIt->first.end())
       {
-        if (&callObjectData != this || callSymbolIt != selfSymIt)
-          fixedEntry.branches_[&(*callSymbolIt)] += branch.second;
+        callObjectData = &objects.at(Range(branchAddress));
+        callSymbolIt = callObjectData->symbols().find(Range(branchAddress));
+        if (callSymbolIt == callObjectData->symbols().end())
+        {
+          callObjectData = nullptr;
+          continue;
+        }
       }
+
+      if (callObjectData != this || callSymbolIt != selfSymIt)
+        fixedEntry.branches_[&(*callSymbolIt)] += branch.second;
     }
 
     if (fixedEntry.branches().size() != 0 || entryData.count() != 0)
@@ -195,36 +418,360 @@ void MemoryObjectData::fixupBranches(const MemoryObjectStorage& objects)
   }
 }
 
-MemoryObjectData::MemoryObjectData(const char* fileName, Size pageOffset)
+MemoryObjectData::MemoryObjectData(const char* fileName, Size pageOffset, uint32_t pid)
 : pageOffset_(pageOffset)
 , fileName_(fileName)
+, pid_(pid)
 {}
 
-void Profile::processMmapEvent(const pe::mmap_event& event)
+bool MemoryObjectData::isJitCode() const
+{
+  // Kernel reports such mappings as "//anon", pgcollect takes "[anon]" and "[anon:name]" from /proc/pid/maps
+  return fileName_ == "//anon" || fileName_.compare(0, 5, "[anon") == 0;
+}
+
+/// JIT compilers supporting perf map jit-pid.dump file into their address space as a marker
+static bool isJitDumpFile(const char* fileName)
+{
+  const char* baseName = strrchr(fileName, '/');
+  baseName = baseName ? baseName + 1 : fileName;
+  const size_t length = strlen(baseName);
+  return strncmp(baseName, "jit-", 4) == 0 && length > 9 && strcmp(baseName + length - 5, ".dump") == 0;
+}
+
+void Profile::processMmapEvent(const pe::mmap_event& event, const uint64_t time)
+{
+  const Range range(event.address, event.address + event.length);
+
+  // Object keeps its real address range unless another one is already there. Repeated mapping of the same file part
+  // reuses the object, others are placed into the synthetic area above any user space address.
+  MemoryObject* memoryObject;
+  auto memoryObjectIt = memoryObjects_.find(range);
+  if (memoryObjectIt == memoryObjects_.end())
+  {
+    memoryObject = &*memoryObjects_.emplace_hint(memoryObjectIt, std::piecewise_construct, std::forward_as_tuple(range),
+                                                  std::forward_as_tuple(event.fileName, event.pageOffset, event.pid));
+  }
+  else if (memoryObjectIt->first.start() == range.start() && memoryObjectIt->first.end() == range.end() &&
+           memoryObjectIt->second.fileName_ == event.fileName && memoryObjectIt->second.pageOffset_ == event.pageOffset)
+  {
+    memoryObject = &*memoryObjectIt;
+  }
+  else
+  {
+    const Range placedRange = range.adjusted(nextSyntheticAddress_ - range.start());
+    nextSyntheticAddress_ = placedRange.end();
+    memoryObject = &*memoryObjects_.emplace(std::piecewise_construct, std::forward_as_tuple(placedRange),
+                                            std::forward_as_tuple(event.fileName, event.pageOffset, event.pid))
+                       .first;
+    memoryObject->second.placementShift_ = placedRange.start() - range.start();
+  }
+
+  memoryObject->second.excluded_ = !filter_.keepsObject(memoryObject->second.fileName_);
+  addressSpace_.insert(range, time, memoryObject);
+  mmapEventCount_++;
+
+  if (isJitDumpFile(event.fileName))
+  {
+    auto& jitDumpFiles = jitDumpFiles_[event.pid];
+    if (std::find(jitDumpFiles.begin(), jitDumpFiles.end(), event.fileName) == jitDumpFiles.end())
+      jitDumpFiles.push_back(event.fileName);
+  }
+}
+
+void Profile::processBuildIdEvent(const pg_build_id_event& event)
 {
-#ifndef NDEBUG
-  auto insRes =
+  static const char hexDigits[] = "0123456789abcdef";
+  std::string& buildId = buildIds_[event.fileName];
+  buildId.clear();
+  for (unsigned i = 0; i < event.buildIdSize && i < PG_BUILD_ID_MAX_SIZE; ++i)
+  {
+    buildId += hexDigits[event.buildId[i] >> 4];
+    buildId += hexDigits[event.buildId[i] & 0xf];
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static const bool callInstructionsKnown = true;
+#else
+// Return addresses are kept as they are on other architectures
+static const bool callInstructionsKnown = false;
 #endif
-    memoryObjects_.emplace(std::piecewise_construct, std::forward_as_tuple(event.address, event.address + event.length),
-                           std::forward_as_tuple(event.fileName, event.pageOffset));
-#ifndef NDEBUG
-  if (!insRes.second)
-  {
-    std::cerr << "Memory object was not inserted! " << event.address << " " << event.length << " "
-              << event.fileName << '\n';
-    std::cerr << "Already have another object: " << insRes.first->first << ' ' << insRes.first->second.fileName()
-              << '\n';
-    for (const auto& memoryObject: memoryObjects_)
-      std::cerr << memoryObject.first << ' ' << memoryObject.second.fileName() << '\n';
-    std::cerr << std::endl;
+
+/// Returns length of x86 call instruction ending right before @a end, or zero if there is no one
+static size_t callInstructionLength(const unsigned char* begin, const unsigned char* end)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  // Direct near call: E8 rel32
+  if (end - begin >= 5 && end[-5] == 0xe8)
+    return 5;
+
+  // Indirect near call: FF /2, its length depends on addressing mode encoded by ModRM and SIB bytes. REX prefix is
+  // not needed to tell it is a call.
+  for (ptrdiff_t length = 2; length <= 7 && length <= end - begin; ++length)
+  {
+    const unsigned char* insn = end - length;
+    const unsigned char modRm = insn[1];
+    if (insn[0] != 0xff || ((modRm >> 3) & 7) != 2)
+      continue;
+
+    const unsigned mod = modRm >> 6;
+    const unsigned rm = modRm & 7;
+    ptrdiff_t expectedLength = 2;
+    if (mod != 3)
+    {
+      if (rm == 4)
+      {
+        if (length < 3)
+          continue;
+        expectedLength++;
+        if (mod == 0 && (insn[2] & 7) == 5)
+          expectedLength += 4;
+      }
+      if (mod == 0 && rm == 5)
+        expectedLength += 4;
+      else if (mod == 1)
+        expectedLength += 1;
+      else if (mod == 2)
+        expectedLength += 4;
+    }
+    if (expectedLength == length)
+      return length;
   }
+  return 0;
+#else
+  (void)begin;
+  (void)end;
+  return 0;
 #endif
-  mmapEventCount_++;
 }
 
-void Profile::processSampleEvent(const pe::sample_event& event, const ProfileMode mode)
+Address Profile::callSite(const MemoryObject& memoryObject, const Address returnAddress)
 {
-  if (event.callchain[0] != PERF_CONTEXT_USER || event.callchainSize < 2)
+  if (!callInstructionsKnown)
+    return returnAddress;
+
+  const auto callSiteIt = callSites_.find(returnAddress);
+  if (callSiteIt != callSites_.end())
+    return callSiteIt->second;
+
+  const MemoryObjectData& objectData = memoryObject.second;
+  auto codeFileIt = codeFiles_.find(objectData.fileName_);
+  if (codeFileIt == codeFiles_.end())
+  {
+    // Generated code and pseudo files like [vdso] can't be read, neither the files changed since collection. Copy
+    // from the symbol store is preferred, as resolvers do.
+    CodeFile codeFile;
+    const auto buildIdIt = buildIds_.find(objectData.fileName_);
+    const std::string buildId = buildIdIt != buildIds_.end() ? buildIdIt->second : std::string();
+    std::string codeFileName;
+    if (!objectData.isJitCode() && objectData.fileName_.compare(0, 1, "[") != 0)
+    {
+      codeFileName =
+        symbolLocations_ ? symbolLocations_->findExecutable(objectData.fileName_, buildId) : objectData.fileName_;
+      codeFile.verified = !buildId.empty() && AddressResolver::fileBuildId(codeFileName.c_str()) == buildId;
+    }
+    if (!codeFileName.empty() && (codeFile.verified || buildId.empty()))
+    {
+      const int fd = open(codeFileName.c_str(), O_RDONLY);
+      struct stat st;
+      if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0)
+      {
+        void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+          codeFile.data = static_cast<const unsigned char*>(data);
+          codeFile.size = st.st_size;
+        }
+      }
+      if (fd != -1)
+        close(fd);
+    }
+    codeFileIt = codeFiles_.emplace(objectData.fileName_, codeFile).first;
+  }
+
+  Address result = returnAddress;
+  const CodeFile& codeFile = codeFileIt->second;
+  const Address fileOffset = returnAddress - memoryObject.first.start() + objectData.pageOffset_;
+  if (codeFile.data && fileOffset <= codeFile.size)
+  {
+    // Longest call instruction with prefixes fits into 16 bytes
+    const unsigned char* end = codeFile.data + fileOffset;
+    // Frame without a call is dropped only if the code is known to be the one which ran
+    const size_t length = callInstructionLength(end - std::min<Address>(fileOffset, 16), end);
+    if (length)
+      result = returnAddress - length;
+    else if (codeFile.verified)
+      result = 0;
+  }
+
+  callSites_.emplace(returnAddress, result);
+  return result;
+}
+
+void Profile::releaseCodeFiles()
+{
+  for (const auto& codeFile: codeFiles_)
+    if (codeFile.second.data)
+      munmap(const_cast<unsigned char*>(codeFile.second.data), codeFile.second.size);
+  codeFiles_.clear();
+  callSites_.clear();
+}
+
+constexpr CallTree::NodeId CallTree::Root;
+constexpr Address CallTree::TruncatedFrame;
+
+CallTree::CallTree(const size_t maxNodes)
+: maxNodes_(std::min<size_t>(std::max<size_t>(maxNodes, 1), std::numeric_limits<NodeId>::max() / 2))
+{
+  nodes_.push_back(Node{0, Root, 0});
+}
+
+void CallTree::appendSample(const Address* frames, size_t frameCount)
+{
+  NodeId node = Root;
+  while (frameCount)
+  {
+    if (!enterChild(node, frames[--frameCount]))
+    {
+      truncatedSamples_++;
+      enterTruncated(node);
+      break;
+    }
+  }
+
+  nodes_[node].count++;
+}
+
+bool CallTree::enterChild(NodeId& node, const Address address)
+{
+  const auto childIt = children_.find(ChildKey{node, address});
+  if (childIt != children_.end())
+  {
+    node = childIt->second;
+    return true;
+  }
+
+  if (nodes_.size() >= maxNodes_)
+    return false;
+  const NodeId child = nodes_.size();
+  nodes_.push_back(Node{address, node, 0});
+  children_.emplace(ChildKey{node, address}, child);
+  node = child;
+  return true;
+}
+
+void CallTree::enterTruncated(NodeId& node)
+{
+  if (node != Root && nodes_[node].address == TruncatedFrame)
+    return;
+
+  const auto insResult = children_.emplace(ChildKey{node, TruncatedFrame}, nodes_.size());
+  if (insResult.second)
+    nodes_.push_back(Node{TruncatedFrame, node, 0});
+  node = insResult.first->second;
+}
+
+std::vector<Count> CallTree::inclusiveCounts() const
+{
+  std::vector<Count> counts(nodes_.size());
+  for (NodeId node = nodes_.size() - 1; node != Root; --node)
+  {
+    counts[node] += nodes_[node].count;
+    counts[nodes_[node].parent] += counts[node];
+  }
+  counts[Root] += nodes_[Root].count;
+  return counts;
+}
+
+void CallTree::restore(std::vector<Node> nodes, const size_t truncatedSamples)
+{
+  nodes_ = std::move(nodes);
+  truncatedSamples_ = truncatedSamples;
+  children_.clear();
+}
+
+void CallTree::replaceAddresses(const std::unordered_set<Address>& addresses, const Address replacement)
+{
+  // Replaced contexts are not merged with existing ones, so children can't be found by address any more
+  children_.clear();
+  for (Node& node: nodes_)
+    if (addresses.count(node.address))
+      node.address = replacement;
+}
+
+void CallTree::removeAddresses(const std::unordered_set<Address>& addresses)
+{
+  children_.clear();
+  // Parents come first, so the parent of a removed node already points to its closest kept ancestor
+  std::vector<bool> removed(nodes_.size());
+  for (NodeId node = Root + 1; node < nodes_.size(); ++node)
+  {
+    Node& nodeData = nodes_[node];
+    if (removed[nodeData.parent])
+      nodeData.parent = nodes_[nodeData.parent].parent;
+    if (addresses.count(nodeData.address))
+    {
+      removed[node] = true;
+      nodeData.count = 0;
+    }
+  }
+}
+
+Address Profile::placeAddress(const Address address, const uint64_t time, MemoryObject*& memoryObject)
+{
+  memoryObject = addressSpace_.find(address, time);
+  if (!memoryObject)
+    return 0;
+
+  // Code which JIT compiler replaced later is moved to the synthetic area of the process
+  const MemoryObjectData& objectData = memoryObject->second;
+  if (monotonicTime_ && objectData.isJitCode() && jitDumpFiles_.count(objectData.pid_))
+  {
+    const JitCode& code = jitCode(objectData.pid_);
+    const Address placedAddress = code.place(address, time);
+    if (placedAddress != address)
+    {
+      auto objectIt = memoryObjects_.find(Range(placedAddress));
+      if (objectIt == memoryObjects_.end())
+      {
+        objectIt = memoryObjects_.emplace(std::piecewise_construct,
+                                          std::forward_as_tuple(Range(code.syntheticStart(), code.syntheticEnd())),
+                                          std::forward_as_tuple("//anon", 0, objectData.pid_))
+                     .first;
+        objectIt->second.excluded_ = objectData.excluded_;
+      }
+      memoryObject = &*objectIt;
+      return placedAddress;
+    }
+  }
+  return address + objectData.placementShift_;
+}
+
+const JitCode& Profile::jitCode(const uint32_t pid)
+{
+  std::shared_ptr<const JitCode>& jitCode = jitCode_[pid];
+  if (!jitCode)
+  {
+    static const std::vector<std::string> noJitDumpFiles;
+    const auto jitDumpFilesIt = jitDumpFiles_.find(pid);
+    jitCode = std::make_shared<const JitCode>(
+      pid, jitDumpFilesIt != jitDumpFiles_.end() ? jitDumpFilesIt->second : noJitDumpFiles, nextSyntheticAddress_);
+    nextSyntheticAddress_ = jitCode->syntheticEnd();
+  }
+  return *jitCode;
+}
+
+void Profile::prepareJitCode()
+{
+  for (const auto& memoryObject: memoryObjects_)
+    if (memoryObject.second.isJitCode())
+      jitCode(memoryObject.second.pid_);
+}
+
+void Profile::processSampleEvent(const pe::Sample& sample, const ProfileMode mode)
+{
+  if (sample.callchainSize < 2 || sample.callchain[0] != PERF_CONTEXT_USER)
   {
     // Callchain which starts not in the user space
 
@@ -232,48 +779,72 @@ void Profile::processSampleEvent(const pe::sample_event& event, const ProfileMod
     return;
   }
 
-  auto memoryObjectIt = memoryObjects_.find(Range(event.ip));
-  if (memoryObjectIt == memoryObjects_.end())
+  if (!filter_.keepsThread(sample.pid, sample.tid))
+  {
+    filteredSamples_++;
+    return;
+  }
+
+  MemoryObject* memoryObject;
+  const Address ip = placeAddress(sample.ip, sample.time, memoryObject);
+  if (!memoryObject)
   {
     // Instruction pointer does not point any memory mapped object
     unmappedSamples_++;
     return;
   }
 
-  memoryObjectIt->second.appendEntry(event.ip, 1);
+  // Filtered objects still appear in callchains of other samples
+  if (memoryObject->second.excluded_)
+  {
+    filteredSamples_++;
+    return;
+  }
+
+  memoryObject->second.appendEntry(ip, 1);
   goodSamplesCount_++;
 
   if (mode != ProfileMode::CallGraph)
     return;
 
   bool skipFrame = false;
-  Address callTo = event.ip;
+  Address callTo = ip;
+  sampleFrames_.assign(1, ip);
 
   // NOTE: On recent kernels callchain depth can be controlled via sysctl kernel.perf_event_max_stack and
-  // kernel.perf_event_max_contexts_per_stack and they can be deeper then PERF_MAX_STACK_DEPTH.
-  for (__u64 i = 2; i < event.callchainSize && i < PERF_MAX_STACK_DEPTH; ++i)
+  // kernel.perf_event_max_contexts_per_stack, whole event is read so deep callchains are used completely.
+  for (__u64 i = 2; i < sample.callchainSize; ++i)
   {
-    Address callFrom = event.callchain[i];
+    Address callFrom = sample.callchain[i];
     if (callFrom > PERF_CONTEXT_MAX)
     {
       // Context switch, and we want only user level
       skipFrame = (callFrom != PERF_CONTEXT_USER);
       continue;
     }
-    if (skipFrame || callFrom == callTo)
+    if (skipFrame)
       continue;
 
-    memoryObjectIt = memoryObjects_.find(Range(callFrom));
-    if (memoryObjectIt == memoryObjects_.end())
+    callFrom = placeAddress(callFrom, sample.time, memoryObject);
+    if (!memoryObject)
       // We rely on frame-pointer based stack unwinding, which is not "reliable". If application was not built with
       // -fno-omit-frame-pointer the callchain will contain invalid entries so we just skip addresses not belonging to
       // any memory object.
       continue;
 
-    memoryObjectIt->second.appendBranch(callFrom, callTo);
+    // Return address points to the instruction next after call, which may even belong to the next function. Invalid
+    // entries which happen to be inside some object don't follow call instruction, they are skipped as well.
+    callFrom = callSite(*memoryObject, callFrom);
+    if (callFrom == 0 || callFrom == callTo)
+      continue;
+
+    memoryObject->second.appendBranch(callFrom, callTo);
+    sampleFrames_.push_back(callFrom);
 
     callTo = callFrom;
   }
+
+  callTree_.appendSample(sampleFrames_.data(), sampleFrames_.size());
 }
 
 void Profile::cleanupMemoryObjects()
@@ -287,40 +858,965 @@ void Profile::cleanupMemoryObjects()
       memoryObjectIt = memoryObjects_.erase(memoryObjectIt);
     }
     else
+    {
+      // Build-id of the file is recorded once after its first mapping
+      const auto buildIdIt = buildIds_.find(memoryObjectIt->second.fileName_);
+      if (buildIdIt != buildIds_.end())
+        memoryObjectIt->second.buildId_ = buildIdIt->second;
       ++memoryObjectIt;
+    }
   }
 }
 
-void Profile::resolveAndFixup(const ProfileDetails details)
+namespace {
+
+/// Identifies the file behind memory object, all objects with the same identity share one resolver
+/** Files are told apart by build-id, otherwise by device, inode and modification time, so one file mapped through
+ *  different paths is parsed once. Path is compared only for files which have neither. */
+struct FileIdentity
 {
+  explicit FileIdentity(const MemoryObjectData& memoryObject)
+  {
+    // Generated code is specific to the process
+    if (memoryObject.isJitCode())
+    {
+      pid = memoryObject.pid();
+      return;
+    }
+
+    if (!memoryObject.buildId().empty())
+    {
+      buildId = memoryObject.buildId();
+      return;
+    }
+
+    struct stat st;
+    if (stat(memoryObject.fileName().c_str(), &st) == 0)
+    {
+      device = st.st_dev;
+      inode = st.st_ino;
+      mtime = st.st_mtime;
+      return;
+    }
+    fileName = memoryObject.fileName();
+  }
+
+  bool operator<(const FileIdentity& rhs) const
+  {
+    return std::tie(buildId, device, inode, mtime, pid, fileName) <
+           std::tie(rhs.buildId, rhs.device, rhs.inode, rhs.mtime, rhs.pid, rhs.fileName);
+  }
+
+  std::string buildId;
+  dev_t device = 0;
+  ino_t inode = 0;
+  time_t mtime = 0;
+  uint32_t pid = 0;
+  std::string fileName;
+};
+
+} // namespace
+
+std::vector<std::vector<MemoryObject*>> Profile::groupObjectsByFile()
+{
+  // Same file is usually mapped several times, group such objects to parse every file only once
+  std::map<FileIdentity, std::vector<MemoryObject*>> objectsByFile;
   for (auto& memoryObject: memoryObjects_)
+    objectsByFile[FileIdentity(memoryObject.second)].push_back(&memoryObject);
+
+  std::vector<std::vector<MemoryObject*>> fileGroups;
+  fileGroups.reserve(objectsByFile.size());
+  for (auto& fileObjects: objectsByFile)
+    fileGroups.push_back(std::move(fileObjects.second));
+  return fileGroups;
+}
+
+std::unique_ptr<AddressResolver> Profile::createResolver(const ProfileDetails details,
+                                                         const MemoryObjectData& memoryObject,
+                                                         const SymbolLocations& locations) const
+{
+  // Generated code is loaded beforehand by prepareJitCode()
+  if (memoryObject.isJitCode())
   {
-    const AddressResolver r(details, memoryObject.second.fileName_.c_str());
-    memoryObject.second.resolveEntries(r, memoryObject.first.start(),
-                                       details == ProfileDetails::Sources ? &sourceFiles_ : 0);
+    const auto& jitCode = jitCode_.at(memoryObject.pid_);
+    return std::unique_ptr<AddressResolver>(new AddressResolver(details, jitCode->pid(), jitCode, locations));
   }
 
+  return std::unique_ptr<AddressResolver>(
+    new AddressResolver(details, memoryObject.fileName_.c_str(), memoryObject.buildId_, locations));
+}
+
+void Profile::noteMismatchedFiles(const std::vector<std::vector<MemoryObject*>>& fileGroups,
+                                  const std::vector<char>& mismatched)
+{
+  for (size_t i = 0; i < fileGroups.size(); ++i)
+    if (mismatched[i])
+      mismatchedFiles_.push_back(fileGroups[i].front()->second.fileName_);
+}
+
+void Profile::prune(const std::vector<std::vector<MemoryObject*>>& fileGroups, const SymbolLocations& locations,
+                    const ProfilePruning& pruning, const unsigned jobs)
+{
+  // Symbols of the same file are ranked together, symbol of every entry is kept for dropping them later
+  std::vector<std::unordered_map<size_t, Count>> symbolCosts(fileGroups.size());
+  std::map<const MemoryObject*, std::vector<size_t>> entrySymbols;
+  for (const auto& fileObjects: fileGroups)
+    for (const MemoryObject* memoryObject: fileObjects)
+      entrySymbols[memoryObject];
+
+  // Ranking needs symbol tables only, resolvers live for one file, so debug info of all files is never held at once
+  const ProfileDetails rankDetails = std::min(details_, ProfileDetails::Symbols);
+  parallelFor(fileGroups.size(), jobs, [&](size_t i) {
+    const auto& r = createResolver(rankDetails, fileGroups[i].front()->second, locations);
+    for (MemoryObject* memoryObject: fileGroups[i])
+    {
+      MemoryObjectData& objectData = memoryObject->second;
+      objectData.usesAbsoluteAddresses_ = r->usesAbsoluteAddresses();
+
+      std::vector<Address> elfAddresses;
+      elfAddresses.reserve(objectData.entries_.size());
+      for (const auto& entry: objectData.entries_)
+        elfAddresses.push_back(objectData.mapToElf(memoryObject->first.start(), entry.first));
+
+      std::vector<size_t>& symbols = entrySymbols.at(memoryObject);
+      r->resolve(elfAddresses, symbols);
+
+      // Calls are part of the caller cost, otherwise outer functions would be dropped first. Filtered symbols are
+      // dropped later anyway, they don't take place of others.
+      std::unordered_map<size_t, bool> keptSymbols;
+      size_t entryIdx = 0;
+      for (const auto& entry: objectData.entries_)
+      {
+        const size_t symbol = symbols[entryIdx++];
+        if (symbol == AddressResolver::NoSymbol)
+          continue;
+        if (filter_.filtersSymbols())
+        {
+          const auto insResult = keptSymbols.emplace(symbol, false);
+          if (insResult.second)
+            insResult.first->second =
+              filter_.keepsSymbol(objectData.symbolName(*r, memoryObject->first.start(), symbol));
+          if (!insResult.first->second)
+            continue;
+        }
+        Count cost = entry.second.count();
+        for (const auto& branch: entry.second.branches())
+          cost += branch.second;
+        symbolCosts[i][symbol] += cost;
+      }
+    }
+  });
+
+  struct RankedSymbol
+  {
+    Count cost;
+    size_t fileGroup;
+    size_t symbol;
+  };
+  std::vector<RankedSymbol> rankedSymbols;
+  for (size_t i = 0; i < symbolCosts.size(); ++i)
+    for (const auto& symbolCost: symbolCosts[i])
+      rankedSymbols.push_back(RankedSymbol{symbolCost.second, i, symbolCost.first});
+  std::sort(rankedSymbols.begin(), rankedSymbols.end(), [](const RankedSymbol& lhs, const RankedSymbol& rhs) {
+    return std::tie(rhs.cost, lhs.fileGroup, lhs.symbol) < std::tie(lhs.cost, rhs.fileGroup, rhs.symbol);
+  });
+
+  Count totalCount = 0;
+  for (const auto& memoryObject: memoryObjects_)
+    for (const auto& entry: memoryObject.second.entries_)
+      totalCount += entry.second.count();
+  const double minCount = totalCount * pruning.minCost / 100;
+
+  // Calls are cut by cost of the call itself, they are not ranked
+  bool anyDropped = false;
+  for (const auto& memoryObject: memoryObjects_)
+    for (const auto& entry: memoryObject.second.entries_)
+      for (const auto& branch: entry.second.branches_)
+        anyDropped |= branch.second < minCount;
+
+  std::vector<std::unordered_set<size_t>> droppedSymbols(fileGroups.size());
+  for (size_t rank = 0; rank < rankedSymbols.size(); ++rank)
+  {
+    const RankedSymbol& rankedSymbol = rankedSymbols[rank];
+    if ((pruning.top && rank >= pruning.top) || rankedSymbol.cost < minCount)
+    {
+      droppedSymbols[rankedSymbol.fileGroup].insert(rankedSymbol.symbol);
+      anyDropped = true;
+    }
+  }
+  if (!anyDropped)
+    return;
+
+  // Other symbol is placed into the synthetic area, so it doesn't overlap any real one
+  const Address otherAddress = nextSyntheticAddress_++;
+  MemoryObjectData& otherData =
+    memoryObjects_.emplace(std::piecewise_construct, std::forward_as_tuple(Range(otherAddress)),
+                           std::forward_as_tuple("[other]", 0)).first->second;
+  otherData.symbols_.emplace(Range(otherAddress), SymbolData("[other]"));
+  EntryData& otherEntry = otherData.appendEntry(otherAddress, 0);
+
+  std::unordered_set<Address> droppedAddresses;
+  for (size_t i = 0; i < fileGroups.size(); ++i)
+  {
+    if (droppedSymbols[i].empty())
+      continue;
+
+    for (MemoryObject* memoryObject: fileGroups[i])
+    {
+      EntryStorage& entries = memoryObject->second.entries_;
+      const std::vector<size_t>& symbols = entrySymbols.at(memoryObject);
+      size_t entryIdx = 0;
+      auto entryIt = entries.begin();
+      while (entryIt != entries.end())
+      {
+        if (!droppedSymbols[i].count(symbols[entryIdx++]))
+        {
+          ++entryIt;
+          continue;
+        }
+
+        otherEntry.count_ += entryIt->second.count();
+        for (const auto& branch: entryIt->second.branches())
+          otherEntry.branches_[branch.first] += branch.second;
+        droppedAddresses.insert(entryIt->first);
+        entryIt = entries.erase(entryIt);
+      }
+    }
+  }
+
+  // Calls of dropped symbols and cheap calls keep their cost as calls of the other one
   for (auto& memoryObject: memoryObjects_)
-    memoryObject.second.fixupBranches(memoryObjects_);
+  {
+    for (auto& entry: memoryObject.second.entries_)
+    {
+      BranchStorage& branches = entry.second.branches_;
+      Count redirectedCount = 0;
+      auto branchIt = branches.begin();
+      while (branchIt != branches.end())
+      {
+        if (droppedAddresses.count(branchIt->first.address) || branchIt->second < minCount)
+        {
+          redirectedCount += branchIt->second;
+          branchIt = branches.erase(branchIt);
+        }
+        else
+          ++branchIt;
+      }
+      if (redirectedCount)
+        branches[otherAddress] += redirectedCount;
+    }
+  }
+  callTree_.replaceAddresses(droppedAddresses, otherAddress);
 }
 
-void Profile::load(std::istream& is, const ProfileMode mode)
+void Profile::resolveAndFixup(const ProfileDetails details, const SymbolLocations& locations, const unsigned jobs,
+                              const ProfilePruning& pruning)
 {
-  pe::perf_event event;
+  details_ = details;
+  prepareJitCode();
+  const auto& fileGroups = groupObjectsByFile();
+
+  if (pruning.isEnabled())
+    prune(fileGroups, locations, pruning, jobs);
+
+  // Files are resolved independently, only source file names are shared
+  std::vector<char> mismatched(fileGroups.size());
+  std::vector<std::vector<Address>> filteredAddresses(fileGroups.size());
+  parallelFor(fileGroups.size(), jobs, [&](size_t i) {
+    const auto& fileObjects = fileGroups[i];
+    const auto& r = createResolver(details, fileObjects.front()->second, locations);
+    mismatched[i] = r->buildIdMismatch();
+    for (MemoryObject* memoryObject: fileObjects)
+      memoryObject->second.resolveEntries(*r, memoryObject->first.start(),
+                                          details >= ProfileDetails::Sources ? &sourceFiles_ : 0,
+                                          details == ProfileDetails::Inlines, filter_, filteredAddresses[i]);
+  });
+  noteMismatchedFiles(fileGroups, mismatched);
+
+  // Calling contexts lose frames of filtered symbols, like their entries are lost
+  std::unordered_set<Address> removedAddresses;
+  for (const auto& addresses: filteredAddresses)
+    removedAddresses.insert(addresses.begin(), addresses.end());
+  if (!removedAddresses.empty())
+    callTree_.removeAddresses(removedAddresses);
+
+  std::vector<MemoryObject*> objects;
+  objects.reserve(memoryObjects_.size());
+  for (auto& memoryObject: memoryObjects_)
+    objects.push_back(&memoryObject);
+
+  // Fixup needs symbols of all objects, so it can start only when resolving is done
+  parallelFor(objects.size(), jobs, [&](size_t i) { objects[i]->second.fixupBranches(memoryObjects_); });
+
+  // Objects having only dropped symbols are left empty
+  if (pruning.isEnabled())
+    cleanupMemoryObjects();
+}
+
+bool Profile::hasThreadIds() const
+{
+  return sampleType_ & PERF_SAMPLE_TID;
+}
+
+uint64_t Profile::eventTime(const pe::perf_event& event, const uint64_t eventIndex) const
+{
+  if (!hasTimestamps(sampleType_, sampleIdAll_))
+    return eventIndex;
+
+  // Time is in sample_id trailer, only ID, STREAM_ID, CPU and IDENTIFIER fields may follow it
+  const uint64_t afterTime = PERF_SAMPLE_ID | PERF_SAMPLE_STREAM_ID | PERF_SAMPLE_CPU | PERF_SAMPLE_IDENTIFIER;
+  const __u64* timeField = event.end() - 1 - __builtin_popcountll(sampleType_ & afterTime);
+  return timeField >= event.data ? *timeField : 0;
+}
+
+void Profile::loadEvents(std::istream& is, const ProfileMode mode, const LoadPass pass)
+{
+  // Buffer fits any event, keep it off the stack
+  std::unique_ptr<pe::perf_event> event(new pe::perf_event);
+  uint64_t eventIndex = 0;
   while (!is.eof() && !is.fail())
   {
-    is >> event;
+    is >> *event;
     if (is.eof() || is.fail())
       break;
-    switch (event.header.type)
+    switch (event->header.type)
     {
+    case PG_RECORD_HEADER:
+      if (pass != LoadPass::Samples)
+      {
+        const auto& header = *reinterpret_cast<const pg_header_event*>(event.get());
+        sampleType_ = header.sampleType;
+        sampleIdAll_ = header.sampleIdAll;
+        monotonicTime_ = hasTimestamps(sampleType_, sampleIdAll_) && (header.flags & PG_HEADER_MONOTONIC_TIME);
+      }
+      break;
     case PERF_RECORD_MMAP:
-      processMmapEvent(event.mmap);
+      if (pass != LoadPass::Samples)
+        processMmapEvent(event->mmap, eventTime(*event, eventIndex));
       break;
     case PERF_RECORD_SAMPLE:
-      processSampleEvent(event.sample, mode);
+      if (pass != LoadPass::Mappings)
+      {
+        pe::Sample sample;
+        if (!pe::decodeSample(*event, sampleType_, sample))
+          break;
+        if (!hasTimestamps(sampleType_, sampleIdAll_))
+          sample.time = eventIndex;
+        processSampleEvent(sample, mode);
+      }
+      break;
+    case PG_RECORD_BUILD_ID:
+      if (pass != LoadPass::Samples)
+        processBuildIdEvent(*reinterpret_cast<const pg_build_id_event*>(event.get()));
     }
+    eventIndex++;
   }
+}
 
+void Profile::load(std::istream& is, const ProfileMode mode)
+{
+  // Files without header record have the layout of the first pgcollect versions
+  sampleType_ = PERF_SAMPLE_IP | PERF_SAMPLE_CALLCHAIN;
+  sampleIdAll_ = false;
+  monotonicTime_ = false;
+
+  // Events from different CPUs are not ordered by time, so all mappings are collected before samples if we can reread
+  // the stream
+  const auto startPos = is.tellg();
+  if (startPos == std::istream::pos_type(-1))
+    loadEvents(is, mode, LoadPass::All);
+  else
+  {
+    loadEvents(is, mode, LoadPass::Mappings);
+    is.clear();
+    is.seekg(startPos);
+    loadEvents(is, mode, LoadPass::Samples);
+  }
+
+  // Address space points into objects which are going to be dropped
+  addressSpace_.clear();
+  releaseCodeFiles();
   cleanupMemoryObjects();
 }
+
+/// Key of memory objects which can share entries, generated code is never shared
+static std::string mergeKey(const MemoryObjectData& memoryObject)
+{
+  if (memoryObject.isJitCode())
+    return std::string();
+  return memoryObject.buildId().empty() ? "file:" + memoryObject.fileName() : "build-id:" + memoryObject.buildId();
+}
+
+void Profile::merge(const Profile& other)
+{
+  // Parts of the same file are told apart by their file offset and length
+  std::multimap<std::string, MemoryObject*> objectsByKey;
+  for (auto& memoryObject: memoryObjects_)
+  {
+    const std::string key = mergeKey(memoryObject.second);
+    if (!key.empty())
+      objectsByKey.emplace(key, &memoryObject);
+  }
+
+  // Generated code is never shared, process of the other capture gets another number if its id is taken here
+  std::unordered_set<uint32_t> jitPids;
+  for (const auto& memoryObject: memoryObjects_)
+    if (memoryObject.second.isJitCode())
+      jitPids.insert(memoryObject.second.pid_);
+  for (const auto& jitDumpFiles: jitDumpFiles_)
+    jitPids.insert(jitDumpFiles.first);
+  for (const auto& jitCode: jitCode_)
+    jitPids.insert(jitCode.first);
+  std::map<uint32_t, uint32_t> otherJitPids;
+  for (const auto& otherObject: other.memoryObjects_)
+    if (otherObject.second.isJitCode())
+      otherJitPids.emplace(otherObject.second.pid_, 0);
+  for (const auto& jitDumpFiles: other.jitDumpFiles_)
+    otherJitPids.emplace(jitDumpFiles.first, 0);
+  for (const auto& jitCode: other.jitCode_)
+    otherJitPids.emplace(jitCode.first, 0);
+  for (auto& otherJitPid: otherJitPids)
+    otherJitPid.second = jitPids.count(otherJitPid.first) ? nextMergedPid_-- : otherJitPid.first;
+
+  // Every address of the other profile is moved by the distance between its object and the matching one here
+  std::unordered_map<const MemoryObjectData*, std::pair<MemoryObject*, Offset>> placements;
+  for (const auto& otherObject: other.memoryObjects_)
+  {
+    const MemoryObjectData& otherData = otherObject.second;
+    MemoryObject* memoryObject = nullptr;
+    const std::string key = mergeKey(otherData);
+    if (!key.empty())
+    {
+      const auto range = objectsByKey.equal_range(key);
+      for (auto objectIt = range.first; objectIt != range.second; ++objectIt)
+      {
+        if (objectIt->second->second.pageOffset_ == otherData.pageOffset_ &&
+            objectIt->second->first.length() == otherObject.first.length())
+        {
+          memoryObject = objectIt->second;
+          break;
+        }
+      }
+    }
+
+    if (!memoryObject)
+    {
+      // Keep the real address if it is free, as loading does
+      const uint32_t pid = otherData.isJitCode() ? otherJitPids.at(otherData.pid_) : otherData.pid_;
+      const Address realStart = otherObject.first.start() - otherData.placementShift_;
+      Range placedRange = otherObject.first.adjusted(-otherData.placementShift_);
+      if (memoryObjects_.find(placedRange) != memoryObjects_.end())
+      {
+        placedRange = placedRange.adjusted(nextSyntheticAddress_ - realStart);
+        nextSyntheticAddress_ = placedRange.end();
+      }
+      memoryObject = &*memoryObjects_.emplace(std::piecewise_construct, std::forward_as_tuple(placedRange),
+                                              std::forward_as_tuple(otherData.fileName_.c_str(), otherData.pageOffset_,
+                                                                    pid))
+                         .first;
+      memoryObject->second.buildId_ = otherData.buildId_;
+      memoryObject->second.placementShift_ = placedRange.start() - realStart;
+      if (!key.empty())
+        objectsByKey.emplace(key, memoryObject);
+    }
+    const Offset delta = memoryObject->first.start() - otherObject.first.start();
+    placements.emplace(&otherData, std::make_pair(memoryObject, delta));
+  }
+
+  auto translate = [&](const Address address) {
+    const auto otherObjectIt = other.memoryObjects_.find(Range(address));
+    if (otherObjectIt == other.memoryObjects_.end())
+      return address;
+    return address + placements.at(&otherObjectIt->second).second;
+  };
+
+  for (const auto& otherObject: other.memoryObjects_)
+  {
+    const auto& placement = placements.at(&otherObject.second);
+    MemoryObjectData& memoryObjectData = placement.first->second;
+    for (const auto& otherEntry: otherObject.second.entries_)
+    {
+      EntryData& entryData =
+        memoryObjectData.appendEntry(otherEntry.first + placement.second, otherEntry.second.count_);
+      for (const auto& branch: otherEntry.second.branches_)
+        entryData.branches_[translate(branch.first.address)] += branch.second;
+    }
+  }
+
+  callTree_.merge(other.callTree_, translate);
+
+  // Replaced code of the other profile is placed by its own functions. Renumbered process has them loaded now, perf
+  // map file is found by its real id.
+  static const std::vector<std::string> noJitDumpFiles;
+  for (const auto& otherJitPid: otherJitPids)
+  {
+    const auto jitDumpFilesIt = other.jitDumpFiles_.find(otherJitPid.first);
+    const auto& jitDumpFiles = jitDumpFilesIt != other.jitDumpFiles_.end() ? jitDumpFilesIt->second : noJitDumpFiles;
+    if (!jitDumpFiles.empty())
+      jitDumpFiles_[otherJitPid.second] = jitDumpFiles;
+
+    const auto jitCodeIt = other.jitCode_.find(otherJitPid.first);
+    if (jitCodeIt != other.jitCode_.end())
+      jitCode_[otherJitPid.second] = jitCodeIt->second;
+    else if (otherJitPid.second != otherJitPid.first)
+    {
+      auto jitCode = std::make_shared<const JitCode>(otherJitPid.first, jitDumpFiles, nextSyntheticAddress_);
+      nextSyntheticAddress_ = jitCode->syntheticEnd();
+      jitCode_[otherJitPid.second] = std::move(jitCode);
+    }
+  }
+
+  mmapEventCount_ += other.mmapEventCount_;
+  goodSamplesCount_ += other.goodSamplesCount_;
+  nonUserSamples_ += other.nonUserSamples_;
+  unmappedSamples_ += other.unmappedSamples_;
+  filteredSamples_ += other.filteredSamples_;
+}
+
+bool Profile::writeSymbolPack(const char* fileName, const SymbolLocations& locations, const unsigned jobs)
+{
+  prepareJitCode();
+  const auto& fileGroups = groupObjectsByFile();
+
+  // Pack has everything for the source detail level, entries of all objects of the file are covered
+  std::vector<std::string> packEntries(fileGroups.size());
+  std::vector<char> mismatched(fileGroups.size());
+  parallelFor(fileGroups.size(), jobs, [&](size_t i) {
+    const auto& fileObjects = fileGroups[i];
+    const auto& r = createResolver(ProfileDetails::Sources, fileObjects.front()->second, locations);
+    mismatched[i] = r->buildIdMismatch();
+
+    std::vector<Address> elfAddresses;
+    for (MemoryObject* memoryObject: fileObjects)
+    {
+      memoryObject->second.usesAbsoluteAddresses_ = r->usesAbsoluteAddresses();
+      for (const auto& entry: memoryObject->second.entries())
+        elfAddresses.push_back(memoryObject->second.mapToElf(memoryObject->first.start(), entry.first));
+    }
+    std::sort(elfAddresses.begin(), elfAddresses.end());
+    elfAddresses.erase(std::unique(elfAddresses.begin(), elfAddresses.end()), elfAddresses.end());
+
+    packEntries[i] = r->symbolPackEntry(elfAddresses);
+  });
+  noteMismatchedFiles(fileGroups, mismatched);
+
+  return AddressResolver::writeSymbolPack(fileName, packEntries);
+}
+
+namespace {
+
+/// Resolved profile layout: header, then arrays of objects, symbols, entries, branches, inline chains, inline frames,
+/// call tree nodes and the string table
+/** Symbols and entries of every object follow those of the previous one, branches of every entry follow those of
+ *  the previous entry. Strings are referred by offsets of their NUL terminated values in the table, branches by indexes
+ *  of called symbols. All records are multiples of 8 bytes, so they are aligned in the mapped file and read in place
+ *  while the profile is built from them. */
+struct ResolvedHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t details;
+  uint64_t objectCount;
+  uint64_t symbolCount;
+  uint64_t entryCount;
+  uint64_t branchCount;
+  uint64_t inlineChainCount;
+  uint64_t inlineFrameCount;
+  uint64_t nodeCount;
+  uint64_t stringTableSize;
+  uint64_t truncatedSamples;
+  uint64_t mmapEventCount;
+  uint64_t goodSamplesCount;
+  uint64_t nonUserSamples;
+  uint64_t unmappedSamples;
+  uint64_t filteredSamples;
+};
+
+struct ResolvedObject
+{
+  uint64_t start;
+  uint64_t end;
+  uint64_t pageOffset;
+  uint64_t placementShift;
+  uint64_t symbolCount;
+  uint64_t entryCount;
+  uint32_t fileName;
+  uint32_t buildId;
+  uint32_t pid;
+  uint32_t flags;
+};
+
+struct ResolvedSymbol
+{
+  uint64_t start;
+  uint64_t end;
+  uint32_t name;
+  uint32_t sourceFile;
+  uint64_t sourceLine;
+};
+
+struct ResolvedEntry
+{
+  uint64_t address;
+  uint64_t count;
+  uint32_t sourceFile;
+  uint32_t inlineChain;
+  uint64_t sourceLine;
+  uint64_t branchCount;
+};
+
+struct ResolvedBranch
+{
+  uint64_t symbol;
+  uint64_t count;
+};
+
+struct ResolvedInlineChain
+{
+  uint64_t firstFrame;
+  uint64_t frameCount;
+};
+
+struct ResolvedInlineFrame
+{
+  uint32_t name;
+  uint32_t declFile;
+  uint32_t callFile;
+  uint32_t reserved;
+  uint64_t declLine;
+  uint64_t callLine;
+};
+
+struct ResolvedNode
+{
+  uint64_t address;
+  uint64_t parent;
+  uint64_t count;
+};
+
+const char resolvedMagic[8] = {'P', 'G', 'P', 'R', 'O', 'F', 'I', 'L'};
+const uint32_t resolvedVersion = 1;
+const uint32_t resolvedAbsoluteAddresses = 1;
+// Special string offset of source files and index of inline chains
+const uint32_t resolvedUnknownFile = UINT32_MAX;
+const uint32_t resolvedNoInlineChain = UINT32_MAX;
+
+/// String table of the resolved profile, every value is stored once
+class ResolvedStrings
+{
+public:
+  uint32_t offset(const std::string& value)
+  {
+    const auto insResult = offsets_.emplace(value, table_.size());
+    if (insResult.second)
+      table_.append(value.c_str(), value.size() + 1);
+    return insResult.first->second;
+  }
+
+  uint32_t fileOffset(const std::string& value) { return &value == &unknownFile ? resolvedUnknownFile : offset(value); }
+
+  const std::string& table() const { return table_; }
+
+private:
+  std::unordered_map<std::string, uint32_t> offsets_;
+  std::string table_;
+};
+
+template <typename Record>
+void writeRecords(std::ostream& os, const std::vector<Record>& records)
+{
+  os.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(Record));
+}
+
+} // namespace
+
+bool Profile::writeResolved(std::ostream& os) const
+{
+  ResolvedStrings strings;
+  std::vector<ResolvedObject> objects;
+  std::vector<ResolvedSymbol> symbols;
+  std::unordered_map<const Symbol*, uint64_t> symbolIndexes;
+  for (const auto& memoryObject: memoryObjects_)
+  {
+    const MemoryObjectData& objectData = memoryObject.second;
+    objects.push_back(ResolvedObject{memoryObject.first.start(), memoryObject.first.end(), objectData.pageOffset_,
+                                     objectData.placementShift_, objectData.symbols_.size(), objectData.entries_.size(),
+                                     strings.offset(objectData.fileName_), strings.offset(objectData.buildId_),
+                                     objectData.pid_,
+                                     objectData.usesAbsoluteAddresses_ ? resolvedAbsoluteAddresses : 0});
+    for (const auto& symbol: objectData.symbols_)
+    {
+      symbolIndexes.emplace(&symbol, symbols.size());
+      symbols.push_back(ResolvedSymbol{symbol.first.start(), symbol.first.end(), strings.offset(symbol.second.name()),
+                                       strings.fileOffset(symbol.second.sourceFile()), symbol.second.sourceLine()});
+    }
+  }
+
+  // Branches point to symbols of any object, so entries go after all symbols got their indexes
+  std::vector<ResolvedEntry> entries;
+  std::vector<ResolvedBranch> branches;
+  std::vector<ResolvedInlineChain> inlineChains;
+  std::vector<ResolvedInlineFrame> inlineFrames;
+  std::unordered_map<const InlineChain*, uint32_t> inlineChainIndexes;
+  for (const auto& memoryObject: memoryObjects_)
+  {
+    for (const auto& entry: memoryObject.second.entries_)
+    {
+      const EntryData& entryData = entry.second;
+      uint32_t inlineChain = resolvedNoInlineChain;
+      if (entryData.inlineChain_)
+      {
+        const auto insResult = inlineChainIndexes.emplace(entryData.inlineChain_, inlineChains.size());
+        if (insResult.second)
+        {
+          inlineChains.push_back(ResolvedInlineChain{inlineFrames.size(), entryData.inlineChain_->size()});
+          for (const InlineFrame& frame: *entryData.inlineChain_)
+            inlineFrames.push_back(ResolvedInlineFrame{strings.offset(frame.name), strings.fileOffset(*frame.declFile),
+                                                       strings.fileOffset(*frame.callFile), 0, frame.declLine,
+                                                       frame.callLine});
+        }
+        inlineChain = insResult.first->second;
+      }
+
+      entries.push_back(ResolvedEntry{entry.first, entryData.count_, strings.fileOffset(*entryData.sourceFile_),
+                                      inlineChain, entryData.sourceLine_, entryData.branches_.size()});
+      for (const Branch* branch: entryData.callsByAddress())
+        branches.push_back(ResolvedBranch{symbolIndexes.at(branch->first.symbol), branch->second});
+    }
+  }
+
+  std::vector<ResolvedNode> nodes;
+  nodes.reserve(callTree_.nodes().size());
+  for (const CallTree::Node& node: callTree_.nodes())
+    nodes.push_back(ResolvedNode{node.address, node.parent, node.count});
+
+  ResolvedHeader header;
+  memcpy(header.magic, resolvedMagic, sizeof(resolvedMagic));
+  header.version = resolvedVersion;
+  header.details = static_cast<uint32_t>(details_);
+  header.objectCount = objects.size();
+  header.symbolCount = symbols.size();
+  header.entryCount = entries.size();
+  header.branchCount = branches.size();
+  header.inlineChainCount = inlineChains.size();
+  header.inlineFrameCount = inlineFrames.size();
+  header.nodeCount = nodes.size();
+  header.stringTableSize = strings.table().size();
+  header.truncatedSamples = callTree_.truncatedSamples();
+  header.mmapEventCount = mmapEventCount_;
+  header.goodSamplesCount = goodSamplesCount_;
+  header.nonUserSamples = nonUserSamples_;
+  header.unmappedSamples = unmappedSamples_;
+  header.filteredSamples = filteredSamples_;
+
+  os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  writeRecords(os, objects);
+  writeRecords(os, symbols);
+  writeRecords(os, entries);
+  writeRecords(os, branches);
+  writeRecords(os, inlineChains);
+  writeRecords(os, inlineFrames);
+  writeRecords(os, nodes);
+  os.write(strings.table().data(), strings.table().size());
+  static const char padding[8] = {};
+  os.write(padding, (8 - strings.table().size() % 8) % 8);
+  return bool(os);
+}
+
+bool Profile::isResolvedProfile(const char* fileName)
+{
+  std::ifstream is(fileName, std::ios_base::binary);
+  char magic[sizeof(resolvedMagic)];
+  return is.read(magic, sizeof(magic)) && memcmp(magic, resolvedMagic, sizeof(resolvedMagic)) == 0;
+}
+
+bool Profile::loadResolved(const char* fileName, const ProfileDetails details, const ProfileMode mode)
+{
+  const int fd = ::open(fileName, O_RDONLY);
+  if (fd == -1)
+  {
+    std::cerr << "Can't open resolved profile " << fileName << ": " << strerror(errno) << '\n';
+    return false;
+  }
+
+  struct stat st;
+  void* mapping = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(ResolvedHeader))
+    mapping = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+
+  const ResolvedHeader* header = static_cast<const ResolvedHeader*>(mapping);
+  if (mapping == MAP_FAILED || memcmp(header->magic, resolvedMagic, sizeof(resolvedMagic)) != 0 ||
+      header->version != resolvedVersion || header->details > static_cast<uint32_t>(ProfileDetails::Inlines))
+  {
+    std::cerr << "File " << fileName << " is not a resolved profile\n";
+    if (mapping != MAP_FAILED)
+      munmap(mapping, st.st_size);
+    return false;
+  }
+
+  bool loaded = false;
+  if (details == ProfileDetails::Objects && header->details != static_cast<uint32_t>(ProfileDetails::Objects))
+    std::cerr << "Profile " << fileName << " is resolved with symbols, it can't be shown by objects\n";
+  else if (!(loaded = loadResolved(static_cast<const char*>(mapping), st.st_size, details, mode)))
+    std::cerr << "Resolved profile " << fileName << " is broken\n";
+  munmap(mapping, st.st_size);
+  return loaded;
+}
+
+bool Profile::loadResolved(const char* data, const size_t size, const ProfileDetails details,
+                           const ProfileMode mode)
+{
+  const ResolvedHeader& header = *reinterpret_cast<const ResolvedHeader*>(data);
+  details_ = std::min(details, static_cast<ProfileDetails>(header.details));
+  const bool keepSources = details_ >= ProfileDetails::Sources;
+  const bool keepInlines = details_ == ProfileDetails::Inlines;
+  const bool keepCalls = mode == ProfileMode::CallGraph;
+
+  // Counts are checked one by one, so sizes of parts can't overflow
+  bool valid = true;
+  size_t offset = sizeof(ResolvedHeader);
+  auto part = [&](const uint64_t count, const size_t recordSize) {
+    valid = valid && count <= (size - offset) / recordSize;
+    const char* result = data + offset;
+    if (valid)
+      offset += count * recordSize;
+    return result;
+  };
+  const auto* objects = reinterpret_cast<const ResolvedObject*>(part(header.objectCount, sizeof(ResolvedObject)));
+  const auto* symbols = reinterpret_cast<const ResolvedSymbol*>(part(header.symbolCount, sizeof(ResolvedSymbol)));
+  const auto* entries = reinterpret_cast<const ResolvedEntry*>(part(header.entryCount, sizeof(ResolvedEntry)));
+  const auto* branches = reinterpret_cast<const ResolvedBranch*>(part(header.branchCount, sizeof(ResolvedBranch)));
+  const auto* inlineChains =
+    reinterpret_cast<const ResolvedInlineChain*>(part(header.inlineChainCount, sizeof(ResolvedInlineChain)));
+  const auto* inlineFrames =
+    reinterpret_cast<const ResolvedInlineFrame*>(part(header.inlineFrameCount, sizeof(ResolvedInlineFrame)));
+  const auto* nodes = reinterpret_cast<const ResolvedNode*>(part(header.nodeCount, sizeof(ResolvedNode)));
+  const char* stringTable = part(header.stringTableSize, 1);
+  if (!valid || header.nodeCount == 0 || (header.stringTableSize && stringTable[header.stringTableSize - 1] != 0))
+    return false;
+
+  // Wrong offsets only mark the profile as broken, it is dropped anyway
+  auto string = [&](const uint32_t stringOffset) {
+    valid = valid && stringOffset < header.stringTableSize;
+    return valid ? stringTable + stringOffset : "";
+  };
+  auto sourceFile = [&](const uint32_t stringOffset) {
+    if (stringOffset == resolvedUnknownFile || !keepSources)
+      return &unknownFile;
+    return sourceFiles_.insert(string(stringOffset));
+  };
+
+  std::vector<MemoryObjectData*> objectData;
+  std::vector<const Symbol*> loadedSymbols;
+  loadedSymbols.reserve(header.symbolCount);
+  for (uint64_t i = 0; i < header.objectCount; ++i)
+  {
+    const ResolvedObject& object = objects[i];
+    if (object.start >= object.end || object.symbolCount > header.symbolCount - loadedSymbols.size())
+      return false;
+    const auto insResult =
+      memoryObjects_.emplace(std::piecewise_construct, std::forward_as_tuple(object.start, object.end),
+                             std::forward_as_tuple(string(object.fileName), object.pageOffset, object.pid));
+    if (!insResult.second)
+      return false;
+    MemoryObjectData& memoryObjectData = insResult.first->second;
+    memoryObjectData.buildId_ = string(object.buildId);
+    memoryObjectData.placementShift_ = object.placementShift;
+    memoryObjectData.usesAbsoluteAddresses_ = object.flags & resolvedAbsoluteAddresses;
+    objectData.push_back(&memoryObjectData);
+
+    for (uint64_t j = 0; j < object.symbolCount; ++j)
+    {
+      const ResolvedSymbol& symbol = symbols[loadedSymbols.size()];
+      if (symbol.start >= symbol.end)
+        return false;
+      const auto symbolIt = memoryObjectData.symbols_.emplace_hint(
+        memoryObjectData.symbols_.end(), std::piecewise_construct, std::forward_as_tuple(symbol.start, symbol.end),
+        std::forward_as_tuple(string(symbol.name), sourceFile(symbol.sourceFile), keepSources ? symbol.sourceLine : 0));
+      loadedSymbols.push_back(&*symbolIt);
+    }
+  }
+
+  // Chains are copied into the object of the first entry using them
+  std::vector<const InlineChain*> loadedInlineChains(header.inlineChainCount);
+  uint64_t entryIndex = 0;
+  uint64_t branchIndex = 0;
+  for (uint64_t i = 0; i < header.objectCount; ++i)
+  {
+    MemoryObjectData& memoryObjectData = *objectData[i];
+    if (objects[i].entryCount > header.entryCount - entryIndex)
+      return false;
+    for (uint64_t j = 0; j < objects[i].entryCount; ++j)
+    {
+      const ResolvedEntry& entry = entries[entryIndex++];
+      if (entry.branchCount > header.branchCount - branchIndex)
+        return false;
+      const ResolvedBranch* entryBranches = branches + branchIndex;
+      branchIndex += entry.branchCount;
+      // Entries having only calls are not sampled in flat mode
+      if (!keepCalls && !entry.count)
+        continue;
+
+      EntryData& entryData =
+        memoryObjectData.entries_
+          .emplace_hint(memoryObjectData.entries_.end(), std::piecewise_construct, std::forward_as_tuple(entry.address),
+                        std::forward_as_tuple(entry.count))
+          ->second;
+      entryData.sourceFile_ = sourceFile(entry.sourceFile);
+      entryData.sourceLine_ = keepSources ? entry.sourceLine : 0;
+
+      if (keepInlines && entry.inlineChain != resolvedNoInlineChain)
+      {
+        if (entry.inlineChain >= header.inlineChainCount)
+          return false;
+        const InlineChain*& inlineChain = loadedInlineChains[entry.inlineChain];
+        if (!inlineChain)
+        {
+          const ResolvedInlineChain& chain = inlineChains[entry.inlineChain];
+          if (chain.firstFrame > header.inlineFrameCount ||
+              chain.frameCount > header.inlineFrameCount - chain.firstFrame)
+            return false;
+          memoryObjectData.inlineChains_.emplace_back();
+          for (uint64_t k = chain.firstFrame; k < chain.firstFrame + chain.frameCount; ++k)
+          {
+            const ResolvedInlineFrame& frame = inlineFrames[k];
+            memoryObjectData.inlineChains_.back().push_back(InlineFrame{string(frame.name), sourceFile(frame.declFile),
+                                                                        frame.declLine, sourceFile(frame.callFile),
+                                                                        frame.callLine});
+          }
+          inlineChain = &memoryObjectData.inlineChains_.back();
+        }
+        entryData.inlineChain_ = inlineChain;
+      }
+
+      for (uint64_t k = 0; keepCalls && k < entry.branchCount; ++k)
+      {
+        const ResolvedBranch& branch = entryBranches[k];
+        if (branch.symbol >= loadedSymbols.size())
+          return false;
+        entryData.branches_.emplace(loadedSymbols[branch.symbol], branch.count);
+      }
+    }
+  }
+
+  // Parents come before their children, flat profile has only the root
+  std::vector<CallTree::Node> treeNodes;
+  const uint64_t nodeCount = keepCalls ? header.nodeCount : 1;
+  treeNodes.reserve(nodeCount);
+  for (uint64_t i = 0; i < nodeCount; ++i)
+  {
+    if (i ? nodes[i].parent >= i : nodes[i].parent != CallTree::Root)
+      return false;
+    const CallTree::NodeId parent = nodes[i].parent;
+    treeNodes.push_back(CallTree::Node{nodes[i].address, parent, keepCalls ? nodes[i].count : 0});
+  }
+  callTree_.restore(std::move(treeNodes), keepCalls ? header.truncatedSamples : 0);
+
+  mmapEventCount_ = header.mmapEventCount;
+  goodSamplesCount_ = header.goodSamplesCount;
+  nonUserSamples_ = header.nonUserSamples;
+  unmappedSamples_ = header.unmappedSamples;
+  filteredSamples_ = header.filteredSamples;
+  return valid;
+}
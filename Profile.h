@@ -1,9 +1,19 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
+#include <deque>
 #include <istream>
+#include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <regex>
+#include <string>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 using Address = std::uint64_t;
 using Count = std::uint64_t;
@@ -80,6 +90,20 @@ union BranchTo
 typedef std::map<BranchTo, Count> BranchStorage;
 typedef BranchStorage::value_type Branch;
 
+/// Function inlined into the symbol or into another inlined function
+struct InlineFrame
+{
+  std::string name;
+  const std::string* declFile;
+  size_t declLine;
+  /// Position of the inlined call in the caller
+  const std::string* callFile;
+  size_t callLine;
+};
+
+/// Inlined functions containing an entry, the outermost one comes first
+using InlineChain = std::vector<InlineFrame>;
+
 class EntryData
 {
 public:
@@ -87,24 +111,70 @@ public:
 
   Count count() const { return count_; }
   const BranchStorage& branches() const { return branches_; }
+  /// Resolved branches ordered by address of the called symbol, their own order depends on where symbols were allocated
+  std::vector<const Branch*> callsByAddress() const;
   const std::string& sourceFile() const { return *sourceFile_; }
   size_t sourceLine() const { return sourceLine_; }
+  /// Inlined functions the entry belongs to, null if it is not in inlined code or they were not resolved
+  const InlineChain* inlineChain() const { return inlineChain_; }
 
 private:
   friend class MemoryObjectData;
+  friend class Profile;
 
   Count count_;
   BranchStorage branches_;
   const std::string* sourceFile_;
   size_t sourceLine_;
+  const InlineChain* inlineChain_ = nullptr;
 };
 
 using EntryStorage = std::map<Address, EntryData>;
 using Entry = EntryStorage::value_type;
 
-typedef std::unordered_set<std::string> StringTable;
+/// Set of unique strings, entries keep pointers to them
+/** Resolving is done by several threads at once, so insertion is serialized. */
+class StringTable
+{
+public:
+  StringTable() = default;
+  StringTable(const StringTable&) = delete;
+  StringTable& operator=(const StringTable&) = delete;
+
+  const std::string* insert(const char* value);
+
+private:
+  std::mutex mutex_;
+  std::unordered_set<std::string> strings_;
+};
+
+/// Parts of the profile which are kept, every empty list keeps everything
+struct ProfileFilter
+{
+  /// Shell wildcard patterns matched against the whole file name of the object where sample was taken
+  std::vector<std::string> includeObjects;
+  std::vector<std::string> excludeObjects;
+  /// Regular expressions searched in symbol names, entries of other symbols are dropped while resolving
+  std::vector<std::regex> includeSymbols;
+  std::vector<std::regex> excludeSymbols;
+  /// Process or thread ids of samples, recorded only by pgcollect writing PERF_SAMPLE_TID
+  std::vector<uint32_t> includeIds;
+  std::vector<uint32_t> excludeIds;
+
+  bool keepsObject(const std::string& fileName) const;
+  bool keepsSymbol(const std::string& name) const;
+  bool keepsThread(uint32_t pid, uint32_t tid) const;
+  bool filtersSymbols() const { return !includeSymbols.empty() || !excludeSymbols.empty(); }
+  bool filtersThreads() const { return !includeIds.empty() || !excludeIds.empty(); }
+  bool isEnabled() const
+  {
+    return !includeObjects.empty() || !excludeObjects.empty() || filtersSymbols() || filtersThreads();
+  }
+};
 
 class AddressResolver;
+class JitCode;
+struct SymbolLocations;
 class MemoryObjectData;
 using MemoryObjectStorage = std::map<Range, MemoryObjectData>;
 using MemoryObject = MemoryObjectStorage::value_type;
@@ -112,58 +182,301 @@ using MemoryObject = MemoryObjectStorage::value_type;
 class MemoryObjectData
 {
 public:
-  MemoryObjectData(const char* fileName, Size pageOffset);
+  MemoryObjectData(const char* fileName, Size pageOffset, uint32_t pid = 0);
   ~MemoryObjectData() = default;
   MemoryObjectData(const MemoryObjectData&) = delete;
   MemoryObjectData& operator=(const MemoryObjectData&) = delete;
 
   const std::string& fileName() const { return fileName_; }
+  /// Build-id of the file in hex recorded during collection, empty if unknown
+  const std::string& buildId() const { return buildId_; }
+  /// Process which mapped the object
+  /** Generated code of merged captures may get another number if the process id is taken by an earlier capture, the
+   *  number keys JIT code of the process in the profile. */
+  uint32_t pid() const { return pid_; }
+  /// Offset of the mapped part in the file
+  Size pageOffset() const { return pageOffset_; }
+  /// Anonymous executable mapping, its code was generated at runtime
+  bool isJitCode() const;
   const EntryStorage& entries() const { return entries_; }
   const SymbolStorage& symbols() const { return symbols_; }
 
   Address mapToElf(const Address startAddress, const Address address) const
   {
-    return usesAbsoluteAddresses_ ? address : address - startAddress + pageOffset_;
+    return usesAbsoluteAddresses_ ? address - placementShift_ : address - startAddress + pageOffset_;
   }
 
   Address mapFromElf(const Address startAddress, const Address address) const
   {
-    return usesAbsoluteAddresses_ ? address : address + startAddress - pageOffset_;
+    return usesAbsoluteAddresses_ ? address + placementShift_ : address + startAddress - pageOffset_;
   }
 
+  /// Address in the process of placed @a address, it differs for objects hidden by later mappings
+  Address realAddress(const Address address) const { return address - placementShift_; }
+
 private:
   friend class Profile;
 
   EntryData& appendEntry(Address address, Count count);
   void appendBranch(Address from, Address to);
 
-  void resolveEntries(const AddressResolver& resolver, Address startAddress, StringTable* sourceFiles);
+  /// Name of resolver @a symbol, fake name is made from the address if it has none
+  std::string symbolName(const AddressResolver& resolver, Address startAddress, size_t symbol) const;
+  /// Addresses of entries dropped by symbol @a filter are appended to @a filteredAddresses
+  void resolveEntries(const AddressResolver& resolver, Address startAddress, StringTable* sourceFiles,
+                      bool resolveInlines, const ProfileFilter& filter, std::vector<Address>& filteredAddresses);
   void fixupBranches(const MemoryObjectStorage& objects);
 
   Size pageOffset_;
   EntryStorage entries_;
   SymbolStorage symbols_;
+  // Entries point to chains stored here
+  std::deque<InlineChain> inlineChains_;
   std::string fileName_;
+  std::string buildId_;
+  uint32_t pid_;
+  // Objects hidden by later mappings are placed at synthetic addresses, this is their distance from the real ones
+  Address placementShift_ = 0;
   bool usesAbsoluteAddresses_ = false;
+  // Samples taken in the object are dropped by the filter
+  bool excluded_ = false;
+};
+
+/// Index of values placed at any address at any moment, memory objects or generated functions
+/** Address space is split into segments at boundaries of all ranges. Every segment keeps generations of values
+ *  sorted by placement time, so lookup is two binary searches. Later placement hides only the overlapped part of
+ *  earlier ones, default constructed value makes a hole. */
+template <typename Value>
+class BasicAddressSpace
+{
+public:
+  void insert(const Range& range, uint64_t time, Value value);
+  /// Returns value placed at @a address at @a time or default constructed one
+  Value find(Address address, uint64_t time) const;
+  /// Tells whether @a value is the last one placed in every part of @a range
+  bool isLatest(const Range& range, Value value) const;
+  /// Calls @a f with ranges and values placed there last in ascending order, holes are skipped
+  template <typename F>
+  void forEachLatest(F f) const;
+  void clear() { segments_.clear(); }
+
+private:
+  struct Generation
+  {
+    uint64_t time;
+    Value value;
+  };
+  using Generations = std::vector<Generation>;
+
+  void split(Address address);
+
+  // Segment lasts till the next one, segments without generations are holes
+  std::map<Address, Generations> segments_;
+};
+
+template <typename Value>
+void BasicAddressSpace<Value>::split(const Address address)
+{
+  auto segmentIt = segments_.upper_bound(address);
+  if (segmentIt == segments_.begin())
+    segments_.emplace_hint(segmentIt, address, Generations());
+  else if ((--segmentIt)->first != address)
+    segments_.emplace_hint(std::next(segmentIt), address, segmentIt->second);
+}
+
+template <typename Value>
+void BasicAddressSpace<Value>::insert(const Range& range, const uint64_t time, Value value)
+{
+  split(range.start());
+  split(range.end());
+
+  const auto endIt = segments_.find(range.end());
+  for (auto segmentIt = segments_.find(range.start()); segmentIt != endIt; ++segmentIt)
+  {
+    // Values placed at the same time are applied in the order of insertion
+    Generations& generations = segmentIt->second;
+    const auto generationIt =
+      std::upper_bound(generations.begin(), generations.end(), time,
+                       [](uint64_t time, const Generation& generation) { return time < generation.time; });
+    generations.insert(generationIt, Generation{time, value});
+  }
+}
+
+template <typename Value>
+Value BasicAddressSpace<Value>::find(const Address address, const uint64_t time) const
+{
+  auto segmentIt = segments_.upper_bound(address);
+  if (segmentIt == segments_.begin())
+    return Value();
+
+  const Generations& generations = (--segmentIt)->second;
+  auto generationIt =
+    std::upper_bound(generations.begin(), generations.end(), time,
+                     [](uint64_t time, const Generation& generation) { return time < generation.time; });
+  if (generationIt == generations.begin())
+    return Value();
+  return (--generationIt)->value;
+}
+
+template <typename Value>
+bool BasicAddressSpace<Value>::isLatest(const Range& range, const Value value) const
+{
+  auto segmentIt = segments_.upper_bound(range.start());
+  if (segmentIt == segments_.begin())
+    return false;
+  for (--segmentIt; segmentIt != segments_.end() && segmentIt->first < range.end(); ++segmentIt)
+    if (segmentIt->second.empty() || segmentIt->second.back().value != value)
+      return false;
+  return true;
+}
+
+template <typename Value>
+template <typename F>
+void BasicAddressSpace<Value>::forEachLatest(F f) const
+{
+  auto segmentIt = segments_.begin();
+  while (segmentIt != segments_.end())
+  {
+    if (segmentIt->second.empty() || segmentIt->second.back().value == Value())
+    {
+      ++segmentIt;
+      continue;
+    }
+
+    // Adjacent segments with the same value make one range, the last segment is always a hole
+    const Address start = segmentIt->first;
+    const Value value = segmentIt->second.back().value;
+    while (++segmentIt != segments_.end() && !segmentIt->second.empty() && segmentIt->second.back().value == value)
+      ;
+    if (segmentIt == segments_.end())
+      break;
+    f(Range(start, segmentIt->first), value);
+  }
+}
+
+using AddressSpace = BasicAddressSpace<MemoryObject*>;
+
+/// Calling context tree, every path from the root is a callchain with the outermost frame first
+/** Frames are placed addresses: sampled instruction for the leaf and call instructions for callers, they match entry
+ *  addresses of memory objects. Children are found through one hash table keyed by parent and frame. Number of nodes
+ *  is bounded, contexts which don't fit are cut at the deepest frame already known and counted in its child with
+ *  TruncatedFrame address. Such children are made over the limit, so there are at most twice as many nodes. */
+class CallTree
+{
+public:
+  using NodeId = uint32_t;
+  static constexpr NodeId Root = 0;
+  static constexpr size_t DefaultMaxNodes = 1 << 22;
+  /// Frame of samples which contexts didn't fit, no code is mapped at zero address
+  static constexpr Address TruncatedFrame = 0;
+
+  struct Node
+  {
+    Address address;
+    NodeId parent;
+    /// Samples taken exactly in this context
+    Count count;
+  };
+
+  explicit CallTree(size_t maxNodes = DefaultMaxNodes);
+
+  /// Adds sample with callchain of @a frameCount @a frames, the innermost frame first
+  void appendSample(const Address* frames, size_t frameCount);
+
+  /// Nodes in the order of creation, so parents always come before their children. Root has no address.
+  const std::vector<Node>& nodes() const { return nodes_; }
+  /// Samples in every context and all contexts called from it, indexed by node
+  std::vector<Count> inclusiveCounts() const;
+  /// Samples which were attributed to TruncatedFrame because the tree was full
+  size_t truncatedSamples() const { return truncatedSamples_; }
+  /// Replaces frames at any of @a addresses by @a replacement, no samples can be added afterwards
+  void replaceAddresses(const std::unordered_set<Address>& addresses, Address replacement);
+  /// Drops frames at any of @a addresses, their callees are called by their callers and their own samples are dropped
+  /** No samples can be added afterwards. */
+  void removeAddresses(const std::unordered_set<Address>& addresses);
+  /// Adds all contexts of @a other, @a translate gives address of its frames in this tree
+  template <typename Translate>
+  void merge(const CallTree& other, Translate translate);
+  /// Replaces the tree by saved @a nodes starting with the root, no samples can be added afterwards
+  void restore(std::vector<Node> nodes, size_t truncatedSamples);
+
+private:
+  /// Moves @a node to its child at @a address, the child is created if needed. Returns false if the tree is full.
+  bool enterChild(NodeId& node, Address address);
+  /// Moves @a node to its child at TruncatedFrame unless it is such child already, the child is created if needed
+  void enterTruncated(NodeId& node);
+
+  struct ChildKey
+  {
+    NodeId parent;
+    Address address;
+    bool operator==(const ChildKey& rhs) const { return parent == rhs.parent && address == rhs.address; }
+  };
+  struct ChildKeyHash
+  {
+    size_t operator()(const ChildKey& key) const { return std::hash<Address>()(key.address * 31 + key.parent); }
+  };
+
+  size_t maxNodes_;
+  size_t truncatedSamples_ = 0;
+  std::vector<Node> nodes_;
+  std::unordered_map<ChildKey, NodeId, ChildKeyHash> children_;
 };
 
+template <typename Translate>
+void CallTree::merge(const CallTree& other, Translate translate)
+{
+  // Parents come first, so place of every context parent in this tree is already known
+  std::vector<NodeId> placedNodes(other.nodes_.size(), Root);
+  nodes_[Root].count += other.nodes_[Root].count;
+  for (NodeId node = 1; node < other.nodes_.size(); ++node)
+  {
+    const Node& otherNode = other.nodes_[node];
+    NodeId placedNode = placedNodes[otherNode.parent];
+    if (!enterChild(placedNode, translate(otherNode.address)))
+    {
+      truncatedSamples_ += otherNode.count;
+      enterTruncated(placedNode);
+    }
+    placedNodes[node] = placedNode;
+    nodes_[placedNode].count += otherNode.count;
+  }
+  truncatedSamples_ += other.truncatedSamples_;
+}
+
 namespace pe
 {
 struct mmap_event;
-struct sample_event;
+struct perf_event;
+struct Sample;
 } // namespace pe
 
+struct pg_build_id_event;
+
 enum class ProfileMode
 {
   Flat,
   CallGraph
 };
 
+/// Every level includes the previous ones
 enum class ProfileDetails
 {
   Objects,
   Symbols,
-  Sources
+  Sources,
+  Inlines
+};
+
+/// Limits on symbols kept by \ref Profile::resolveAndFixup, cost of the dropped ones goes to one "[other]" symbol
+struct ProfilePruning
+{
+  /// Symbols with smaller share of all samples in percents are dropped, so are calls of smaller cost, zero keeps all
+  double minCost = 0;
+  /// Number of the most expensive symbols which are kept, zero keeps all of them
+  size_t top = 0;
+
+  bool isEnabled() const { return minCost > 0 || top > 0; }
 };
 
 class Profile
@@ -171,30 +484,130 @@ class Profile
 public:
   Profile() = default;
 
+  /// Sets parts of the profile which are kept, has to be called before loading
+  void setFilter(ProfileFilter filter) { filter_ = std::move(filter); }
+  /// Sets limit of call tree nodes, see CallTree, has to be called before loading
+  void setMaxContexts(size_t maxNodes) { callTree_ = CallTree(maxNodes); }
+  /// Sets where code of mapped files is looked for to check callchains, has to be called before loading
+  void setSymbolLocations(const SymbolLocations* locations) { symbolLocations_ = locations; }
   void load(std::istream& is, ProfileMode mode);
+  /// Adds samples of @a other loaded in the same mode, objects of the same file share entries by file offset
+  /** Files are matched by build-id (by name if it is unknown), so captures from different hosts can be merged in
+   *  spite of address space randomization. Both profiles have to be unresolved. */
+  void merge(const Profile& other);
   size_t mmapEventCount() const { return mmapEventCount_; }
   size_t goodSamplesCount() const { return goodSamplesCount_; }
   size_t nonUserSamples() const { return nonUserSamples_; }
   size_t unmappedSamples() const { return unmappedSamples_; }
-
-  void resolveAndFixup(ProfileDetails details);
+  size_t filteredSamples() const { return filteredSamples_; }
+  /// Returns true if samples have process and thread ids, so they can be filtered by them
+  bool hasThreadIds() const;
+
+  /// Resolves symbols (and source positions) of all entries, @a jobs threads are used, zero means all CPUs
+  /** Symbols are ranked by cost spent in them and in calls they make. Those dropped by @a pruning are merged into
+   *  "[other]" symbol of its own memory object before source positions are looked up, calls of them become calls of
+   *  "[other]", and so do calls which cost less than the minimal cost. */
+  void resolveAndFixup(ProfileDetails details, const SymbolLocations& locations, unsigned jobs = 0,
+                       const ProfilePruning& pruning = ProfilePruning());
+
+  /// Writes symbols and line tables needed to resolve all entries into symbol pack @a fileName
+  bool writeSymbolPack(const char* fileName, const SymbolLocations& locations, unsigned jobs = 0);
+
+  /// Writes the resolved profile in binary form, which is loaded back without resolving anything
+  bool writeResolved(std::ostream& os) const;
+  /// Loads profile written by writeResolved() instead of load() and resolveAndFixup()
+  /** Source positions and inlined functions are dropped if @a details are lower than the saved ones, object level
+   *  can't be made of a profile resolved with symbols. Calls are dropped in flat @a mode. Returns false if the file
+   *  can't be loaded. */
+  bool loadResolved(const char* fileName, ProfileDetails details, ProfileMode mode);
+  /// Returns true if @a fileName was written by writeResolved()
+  static bool isResolvedProfile(const char* fileName);
+  /// Detail level the profile was resolved with
+  ProfileDetails details() const { return details_; }
 
   const MemoryObjectStorage& memoryObjects() const { return memoryObjects_; }
+  /// Files which were not used for resolving because their build-id differs from the recorded one
+  const std::vector<std::string>& mismatchedFiles() const { return mismatchedFiles_; }
+  /// Calling contexts of all samples, empty unless the profile was loaded in call graph mode
+  const CallTree& callTree() const { return callTree_; }
 
 private:
   Profile(const Profile&);
   Profile& operator=(const Profile&);
 
-  void processMmapEvent(const pe::mmap_event& event);
-  void processSampleEvent(const pe::sample_event& event, ProfileMode mode);
+  enum class LoadPass
+  {
+    All,
+    Mappings,
+    Samples
+  };
+  void loadEvents(std::istream& is, ProfileMode mode, LoadPass pass);
+  uint64_t eventTime(const pe::perf_event& event, uint64_t eventIndex) const;
+
+  void processMmapEvent(const pe::mmap_event& event, uint64_t time);
+  void processSampleEvent(const pe::Sample& sample, ProfileMode mode);
+  void processBuildIdEvent(const pg_build_id_event& event);
+  /// Finds object mapped at @a address at @a time and translates the address into its placed range
+  /** @a memoryObject is set to null when nothing was mapped there. */
+  Address placeAddress(Address address, uint64_t time, MemoryObject*& memoryObject);
+  /// Functions generated by process @a pid, they are loaded on first use
+  const JitCode& jitCode(uint32_t pid);
+  void prepareJitCode();
+  /// Returns address of call instruction which returns to @a returnAddress
+  /** Return address itself is returned when code of the object can't be read, or there is no call but the code can't
+   *  be checked by build-id. Zero means there is no call and the frame is garbage left by broken frame pointer chain. */
+  Address callSite(const MemoryObject& memoryObject, Address returnAddress);
+  void releaseCodeFiles();
 
   void cleanupMemoryObjects();
-
+  std::vector<std::vector<MemoryObject*>> groupObjectsByFile();
+  /// Collects files of groups which resolvers found @a mismatched build-ids
+  void noteMismatchedFiles(const std::vector<std::vector<MemoryObject*>>& fileGroups,
+                           const std::vector<char>& mismatched);
+  void prune(const std::vector<std::vector<MemoryObject*>>& fileGroups, const SymbolLocations& locations,
+             const ProfilePruning& pruning, unsigned jobs);
+  std::unique_ptr<AddressResolver> createResolver(ProfileDetails details, const MemoryObjectData& memoryObject,
+                                                  const SymbolLocations& locations) const;
+  bool loadResolved(const char* data, size_t size, ProfileDetails details, ProfileMode mode);
+
+  ProfileFilter filter_;
+  const SymbolLocations* symbolLocations_ = nullptr;
+  ProfileDetails details_ = ProfileDetails::Sources;
   MemoryObjectStorage memoryObjects_;
+  CallTree callTree_;
+  // Frames of the sample being processed, kept to avoid allocations
+  std::vector<Address> sampleFrames_;
+  AddressSpace addressSpace_;
+  Address nextSyntheticAddress_ = 0xfff0000000000000;
   StringTable sourceFiles_;
+  std::unordered_map<std::string, std::string> buildIds_;
+  std::vector<std::string> mismatchedFiles_;
+  // Jitdump files mapped by JIT compilers as markers, by process
+  std::unordered_map<uint32_t, std::vector<std::string>> jitDumpFiles_;
+  std::unordered_map<uint32_t, std::shared_ptr<const JitCode>> jitCode_;
+  // Processes of merged captures which ids are taken get numbers counting down from the largest one
+  uint32_t nextMergedPid_ = std::numeric_limits<uint32_t>::max();
+
+  // Mapped files which code is checked at return addresses while loading, and results of the checks
+  struct CodeFile
+  {
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+    // Build-id of the file is the recorded one
+    bool verified = false;
+  };
+  std::unordered_map<std::string, CodeFile> codeFiles_;
+  std::unordered_map<Address, Address> callSites_;
+
+  // Layout of records, see pg_header_event
+  uint64_t sampleType_ = 0;
+  bool sampleIdAll_ = false;
+  // Sample times can be compared with timestamps of jitdump records
+  bool monotonicTime_ = false;
 
   size_t mmapEventCount_ = 0;
   size_t goodSamplesCount_ = 0;
   size_t nonUserSamples_ = 0;
   size_t unmappedSamples_ = 0;
+  size_t filteredSamples_ = 0;
 };
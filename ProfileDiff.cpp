@@ -0,0 +1,222 @@
+#include "ProfileDiff.h"
+#include "AddressResolver.h"
+#include "CallgrindWriter.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <unordered_map>
+
+namespace {
+
+Count cost(const std::array<Count, 2>& self, const std::map<size_t, std::array<Count, 2>>& calls, const size_t side)
+{
+  Count result = self[side];
+  for (const auto& call: calls)
+    result += call.second[side];
+  return result;
+}
+
+void writeCosts(callgrind::OutputBuffer& out, const std::array<Count, 2>& costs)
+{
+  const Count before = costs[ProfileDiff::Before];
+  const Count after = costs[ProfileDiff::After];
+  out << "0 " << before << ' ' << after << ' ' << (after > before ? after - before : 0) << ' '
+      << (before > after ? before - after : 0) << '\n';
+}
+
+int64_t change(const std::array<Count, 2>& costs)
+{
+  return int64_t(costs[ProfileDiff::After]) - int64_t(costs[ProfileDiff::Before]);
+}
+
+double share(const Count count, const Count total)
+{
+  return total ? 100.0 * count / total : 0;
+}
+
+} // namespace
+
+ProfileDiff::ProfileDiff(const Profile& before, const Profile& after)
+: totals_{{0, 0}}
+{
+  std::unordered_map<std::string, std::string> objectNamesByBuildId;
+  add(before, Before, objectNamesByBuildId);
+  add(after, After, objectNamesByBuildId);
+}
+
+size_t ProfileDiff::symbolIndex(const std::string& objectName, const std::string& name)
+{
+  const auto insResult = symbolIndexes_.emplace(std::make_pair(objectName, name), symbols_.size());
+  if (insResult.second)
+    symbols_.push_back(SymbolCosts{objectName, name, Costs{{0, 0}}, {}});
+  return insResult.first->second;
+}
+
+void ProfileDiff::add(const Profile& profile, const Side side,
+                      std::unordered_map<std::string, std::string>& objectNamesByBuildId)
+{
+  // Branches point to symbols, so all of them get their indexes first. Symbols without names are named by their
+  // address, it is made relative to the ELF file to be the same in both profiles.
+  std::unordered_map<const Symbol*, size_t> indexes;
+  for (const auto& memoryObject: profile.memoryObjects())
+  {
+    // Files may be installed elsewhere, they are matched by base name. Renamed file keeps the name it had before if
+    // it is the same build.
+    const MemoryObjectData& objectData = memoryObject.second;
+    std::string objectName = objectData.fileName().substr(objectData.fileName().rfind('/') + 1);
+    if (!objectData.buildId().empty())
+      objectName = objectNamesByBuildId.emplace(objectData.buildId(), objectName).first->second;
+
+    for (const auto& symbol: objectData.symbols())
+    {
+      const Address symbolStart = symbol.first.start();
+      if (symbol.second.name() == AddressResolver::constructSymbolNameFromAddress(symbolStart))
+      {
+        const Address elfAddress = objectData.mapToElf(memoryObject.first.start(), symbolStart);
+        indexes.emplace(&symbol,
+                        symbolIndex(objectName, AddressResolver::constructSymbolNameFromAddress(elfAddress)));
+      }
+      else
+        indexes.emplace(&symbol, symbolIndex(objectName, symbol.second.name()));
+    }
+  }
+
+  for (const auto& memoryObject: profile.memoryObjects())
+  {
+    const SymbolStorage& symbols = memoryObject.second.symbols();
+    for (const auto& entry: memoryObject.second.entries())
+    {
+      const auto symbolIt = symbols.find(Range(entry.first));
+      if (symbolIt == symbols.end())
+        continue;
+
+      SymbolCosts& symbolCosts = symbols_[indexes.at(&*symbolIt)];
+      symbolCosts.self[side] += entry.second.count();
+      totals_[side] += entry.second.count();
+      for (const auto& branch: entry.second.branches())
+        symbolCosts.calls[indexes.at(branch.first.symbol)][side] += branch.second;
+    }
+  }
+}
+
+void ProfileDiff::prune(const double minChange)
+{
+  const double minCount = std::max(totals_[Before], totals_[After]) * minChange / 100;
+  std::vector<bool> dropped(symbols_.size());
+  bool anyDropped = false;
+  for (size_t i = 0; i < symbols_.size(); ++i)
+  {
+    const Count before = cost(symbols_[i].self, symbols_[i].calls, Before);
+    const Count after = cost(symbols_[i].self, symbols_[i].calls, After);
+    dropped[i] = (after > before ? after - before : before - after) < minCount;
+    anyDropped |= dropped[i];
+  }
+  if (!anyDropped)
+    return;
+
+  std::vector<SymbolCosts> symbols;
+  symbols.swap(symbols_);
+  symbolIndexes_.clear();
+  std::vector<size_t> indexes(symbols.size());
+  for (size_t i = 0; i < symbols.size(); ++i)
+    indexes[i] = dropped[i] ? symbolIndex("[other]", "[other]") : symbolIndex(symbols[i].objectName, symbols[i].name);
+
+  // Calls between merged symbols disappear, like recursive calls do
+  for (size_t i = 0; i < symbols.size(); ++i)
+  {
+    SymbolCosts& symbolCosts = symbols_[indexes[i]];
+    symbolCosts.self[Before] += symbols[i].self[Before];
+    symbolCosts.self[After] += symbols[i].self[After];
+    for (const auto& call: symbols[i].calls)
+    {
+      const size_t callIndex = indexes[call.first];
+      if (callIndex == indexes[i])
+        continue;
+      Costs& callCosts = symbolCosts.calls[callIndex];
+      callCosts[Before] += call.second[Before];
+      callCosts[After] += call.second[After];
+    }
+  }
+}
+
+bool ProfileDiff::writeCallgrind(std::ostream& os) const
+{
+  // Output is written at once, so it is one chunk which defines every name
+  callgrind::Names names;
+  for (const SymbolCosts& symbolCosts: symbols_)
+  {
+    names.insert(callgrind::Objects, symbolCosts.objectName, 0);
+    names.insert(callgrind::Functions, symbolCosts.name, 0);
+  }
+
+  callgrind::OutputBuffer out;
+  callgrind::NameWriter nameWriter(out, names, 0);
+  out << "positions: line\n";
+  out << "events: Before After Increase Decrease\n\n";
+
+  const std::string* objectName = nullptr;
+  for (const auto& symbolIndex: symbolIndexes_)
+  {
+    const SymbolCosts& symbolCosts = symbols_[symbolIndex.second];
+    if (!symbolCosts.self[Before] && !symbolCosts.self[After] && symbolCosts.calls.empty())
+      continue;
+
+    if (!objectName || *objectName != symbolCosts.objectName)
+    {
+      objectName = &symbolCosts.objectName;
+      nameWriter.write("ob=", callgrind::Objects, *objectName);
+    }
+    nameWriter.write("fn=", callgrind::Functions, symbolCosts.name);
+    if (symbolCosts.self[Before] || symbolCosts.self[After])
+      writeCosts(out, symbolCosts.self);
+
+    for (const auto& call: symbolCosts.calls)
+    {
+      const SymbolCosts& callCosts = symbols_[call.first];
+      nameWriter.write("cob=", callgrind::Objects, callCosts.objectName);
+      nameWriter.write("cfn=", callgrind::Functions, callCosts.name);
+      out << "calls=1 0\n";
+      writeCosts(out, call.second);
+    }
+    out << '\n';
+  }
+
+  os.write(out.data().data(), out.data().size());
+  return bool(os);
+}
+
+void ProfileDiff::writeReport(std::ostream& os, const size_t count) const
+{
+  std::vector<const SymbolCosts*> changed;
+  for (const SymbolCosts& symbolCosts: symbols_)
+    if (symbolCosts.self[Before] != symbolCosts.self[After])
+      changed.push_back(&symbolCosts);
+  // Ties are broken by names, so the report doesn't depend on order of loading
+  std::sort(changed.begin(), changed.end(), [](const SymbolCosts* lhs, const SymbolCosts* rhs) {
+    const int64_t lhsChange = change(lhs->self);
+    const int64_t rhsChange = change(rhs->self);
+    return std::tie(rhsChange, lhs->objectName, lhs->name) < std::tie(lhsChange, rhs->objectName, rhs->name);
+  });
+
+  os << "total samples: " << totals_[Before] << " before, " << totals_[After] << " after, change " << std::showpos
+     << change(totals_) << std::noshowpos << '\n';
+
+  auto writeSymbol = [&](const SymbolCosts& symbolCosts) {
+    os << std::setw(10) << std::showpos << change(symbolCosts.self) << std::noshowpos << std::setw(10)
+       << symbolCosts.self[Before] << std::setw(10) << symbolCosts.self[After] << std::fixed << std::setprecision(2)
+       << std::setw(8) << share(symbolCosts.self[Before], totals_[Before]) << '%' << std::setw(8)
+       << share(symbolCosts.self[After], totals_[After]) << "%  " << symbolCosts.name << " ["
+       << symbolCosts.objectName << "]\n";
+  };
+  const char* header = "    change    before     after  before%   after%  symbol [object]\n";
+
+  os << "\ntop regressions by self cost:\n" << header;
+  size_t written = 0;
+  for (auto it = changed.begin(); it != changed.end() && written < count && change((*it)->self) > 0; ++it, ++written)
+    writeSymbol(**it);
+
+  os << "\ntop improvements by self cost:\n" << header;
+  written = 0;
+  for (auto it = changed.rbegin(); it != changed.rend() && written < count && change((*it)->self) < 0; ++it, ++written)
+    writeSymbol(**it);
+}
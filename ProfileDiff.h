@@ -0,0 +1,57 @@
+#pragma once
+
+#include "Profile.h"
+
+#include <array>
+#include <map>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/// Costs of symbols of two resolved profiles, the profile taken before a change and the one taken after it
+/** Symbols are matched by base name of their object file and by their name, addresses are not compared at all, so
+ *  different builds of the same binaries installed and loaded anywhere can be compared. Object which build-id didn't
+ *  change is matched even if its file was renamed, it is named as before. */
+class ProfileDiff
+{
+public:
+  enum Side
+  {
+    Before,
+    After
+  };
+
+  ProfileDiff(const Profile& before, const Profile& after);
+
+  /// Merges symbols which cost changed by less than @a minChange percent of the larger total into "[other]"
+  /** Cost of a symbol includes calls it makes, so callers of changed symbols are kept. Calls of merged symbols become
+   *  calls of "[other]". */
+  void prune(double minChange);
+
+  /// Writes callgrind data with costs before and after, and their difference split into increase and decrease events
+  bool writeCallgrind(std::ostream& os) const;
+  /// Writes @a count symbols which self cost increased the most, and @a count ones which decreased the most
+  void writeReport(std::ostream& os, size_t count) const;
+
+private:
+  typedef std::array<Count, 2> Costs;
+
+  struct SymbolCosts
+  {
+    std::string objectName;
+    std::string name;
+    Costs self;
+    /// Costs of calls by index of the called symbol
+    std::map<size_t, Costs> calls;
+  };
+
+  /// Adds costs of @a profile, @a objectNamesByBuildId keeps names given to objects of the earlier added profiles
+  void add(const Profile& profile, Side side, std::unordered_map<std::string, std::string>& objectNamesByBuildId);
+  size_t symbolIndex(const std::string& objectName, const std::string& name);
+
+  std::vector<SymbolCosts> symbols_;
+  std::map<std::pair<std::string, std::string>, size_t> symbolIndexes_;
+  Costs totals_;
+};
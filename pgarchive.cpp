@@ -0,0 +1,108 @@
+#include "Profile.h"
+#include "AddressResolver.h"
+
+#include <fstream>
+#include <iostream>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <getopt.h>
+
+struct Params
+{
+  Params()
+  {
+    symbolLocations.cacheDir = SymbolLocations::defaultCacheDir();
+  }
+  unsigned jobs = 0;
+  SymbolLocations symbolLocations;
+  const char* inputFile = nullptr;
+  std::string outputFile;
+};
+
+static void __attribute__((noreturn))
+printUsage()
+{
+  std::cout << "Usage: " << program_invocation_short_name
+            << " [-j jobs] [-c cachedir] [-s debugdir]... [-S storedir] filename.pgdata [filename.pgsym]\n";
+  exit(EXIT_SUCCESS);
+}
+
+static void parseArguments(Params& params, int argc, char* argv[])
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "j:c:s:S:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'j': {
+      char* endptr;
+      params.jobs = strtoul(optarg, &endptr, 10);
+      if (*endptr != 0 || params.jobs == 0)
+      {
+        std::cerr << "Invalid number of jobs '" << optarg << "'\n";
+        exit(EXIT_FAILURE);
+      }}
+      break;
+    case 'c':
+      params.symbolLocations.cacheDir = optarg;
+      break;
+    case 's':
+      params.symbolLocations.debugDirs.push_back(optarg);
+      break;
+    case 'S':
+      params.symbolLocations.storeDir = optarg;
+      break;
+    default:
+      printUsage();
+    }
+  }
+
+  if (optind == argc || argc - optind > 2)
+    printUsage();
+
+  params.inputFile = argv[optind];
+  if (argc - optind == 2)
+    params.outputFile = argv[optind + 1];
+  else
+  {
+    // filename.pgdata -> filename.pgsym
+    params.outputFile = params.inputFile;
+    const size_t suffixPos = params.outputFile.rfind(".pgdata");
+    if (suffixPos != std::string::npos && suffixPos + strlen(".pgdata") == params.outputFile.size())
+      params.outputFile.erase(suffixPos);
+    params.outputFile += ".pgsym";
+  }
+}
+
+int main(int argc, char** argv)
+{
+  Params params;
+  parseArguments(params, argc, argv);
+
+  std::fstream input(params.inputFile, std::ios_base::in);
+  if (!input)
+  {
+    std::cerr << "Error reading input file " << params.inputFile << '\n';
+    exit(EXIT_FAILURE);
+  }
+
+  // Call graph mode keeps all addresses which have to be resolved later
+  Profile profile;
+  profile.setSymbolLocations(&params.symbolLocations);
+  profile.load(input, ProfileMode::CallGraph);
+  input.close();
+
+  if (!profile.writeSymbolPack(params.outputFile.c_str(), params.symbolLocations, params.jobs))
+  {
+    std::cerr << "Can't write symbol pack " << params.outputFile << '\n';
+    exit(EXIT_FAILURE);
+  }
+  for (const std::string& fileName: profile.mismatchedFiles())
+    std::cerr << "Build-id of " << fileName << " differs from the recorded one, the file was skipped\n";
+
+  std::cout << "Symbols of " << profile.memoryObjects().size() << " objects written to " << params.outputFile << '\n';
+
+  return 0;
+}
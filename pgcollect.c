@@ -1,4 +1,7 @@
+#include "pgdata.h"
+
 #include <dirent.h>
+#include <elf.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
@@ -10,6 +13,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/mman.h>
@@ -34,6 +38,11 @@ struct PGCollectState
   unsigned sampleCount;
   unsigned mmapCount;
   unsigned synthMmapCount;
+  unsigned buildIdCount;
+  // Open addressing hash set of files which build-id was written, capacity is a power of two
+  char** buildIdFiles;
+  unsigned buildIdFileCount;
+  unsigned buildIdFileAlloc;
 };
 
 struct PerfMmapArea
@@ -89,6 +98,182 @@ static void collectTasks(struct PGCollectState* state, pid_t pid)
   closedir(taskDir);
 }
 
+static bool readAll(int fd, void* buf, size_t size, off_t offset)
+{
+  return pread(fd, buf, size, offset) == (ssize_t)size;
+}
+
+/* Looks for NT_GNU_BUILD_ID note in PT_NOTE segments, returns size of build-id or 0 */
+static size_t readBuildId(const char* fileName, __u8* buildId)
+{
+  int fd = open(fileName, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return 0;
+
+  size_t buildIdSize = 0;
+  union {
+    unsigned char ident[EI_NIDENT];
+    Elf32_Ehdr e32;
+    Elf64_Ehdr e64;
+  } ehdr;
+  if (!readAll(fd, &ehdr, sizeof(ehdr), 0) || memcmp(ehdr.ident, ELFMAG, SELFMAG) != 0)
+    goto out;
+
+  const bool is64 = ehdr.ident[EI_CLASS] == ELFCLASS64;
+  const off_t phOffset = is64 ? ehdr.e64.e_phoff : ehdr.e32.e_phoff;
+  const size_t phSize = is64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr);
+  const unsigned phCount = is64 ? ehdr.e64.e_phnum : ehdr.e32.e_phnum;
+
+  for (unsigned i = 0; i < phCount && buildIdSize == 0; i++)
+  {
+    union {
+      Elf32_Phdr p32;
+      Elf64_Phdr p64;
+    } phdr;
+    if (!readAll(fd, &phdr, phSize, phOffset + i * phSize))
+      break;
+    if ((is64 ? phdr.p64.p_type : phdr.p32.p_type) != PT_NOTE)
+      continue;
+
+    const off_t noteOffset = is64 ? phdr.p64.p_offset : phdr.p32.p_offset;
+    const size_t noteSize = is64 ? phdr.p64.p_filesz : phdr.p32.p_filesz;
+    const size_t noteAlign = (is64 ? phdr.p64.p_align : phdr.p32.p_align) == 8 ? 8 : 4;
+    if (noteSize > 64 * 1024)
+      continue;
+
+    char notes[noteSize];
+    if (!readAll(fd, notes, noteSize, noteOffset))
+      continue;
+
+    size_t pos = 0;
+    while (pos + sizeof(Elf64_Nhdr) <= noteSize)
+    {
+      Elf64_Nhdr nhdr; // Same layout as Elf32_Nhdr
+      memcpy(&nhdr, notes + pos, sizeof(nhdr));
+      const size_t namePos = pos + sizeof(nhdr);
+      const size_t descPos = namePos + ((nhdr.n_namesz + noteAlign - 1) & ~(noteAlign - 1));
+      pos = descPos + ((nhdr.n_descsz + noteAlign - 1) & ~(noteAlign - 1));
+      if (descPos + nhdr.n_descsz > noteSize)
+        break;
+      if (nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_namesz == sizeof(ELF_NOTE_GNU) &&
+          memcmp(notes + namePos, ELF_NOTE_GNU, sizeof(ELF_NOTE_GNU)) == 0 && nhdr.n_descsz > 0 &&
+          nhdr.n_descsz <= PG_BUILD_ID_MAX_SIZE)
+      {
+        buildIdSize = nhdr.n_descsz;
+        memcpy(buildId, notes + descPos, buildIdSize);
+        break;
+      }
+    }
+  }
+
+out:
+  close(fd);
+  return buildIdSize;
+}
+
+static unsigned hashFileName(const char* fileName)
+{
+  // FNV-1a
+  unsigned hash = 2166136261u;
+  for (; *fileName; fileName++)
+    hash = (hash ^ (unsigned char)*fileName) * 16777619u;
+  return hash;
+}
+
+/* Returns slot of the file in the set of files, or the empty slot where it belongs */
+static char** findBuildIdFile(char** files, unsigned alloc, const char* fileName)
+{
+  unsigned i = hashFileName(fileName) & (alloc - 1);
+  while (files[i] && strcmp(files[i], fileName) != 0)
+    i = (i + 1) & (alloc - 1);
+  return &files[i];
+}
+
+/* Adds the file to the set, returns false if it is already there. Files which can't be stored are never found */
+static bool addBuildIdFile(struct PGCollectState* state, const char* fileName)
+{
+  if (state->buildIdFileAlloc && *findBuildIdFile(state->buildIdFiles, state->buildIdFileAlloc, fileName))
+    return false;
+
+  // Set is kept at most half full, so probe sequences stay short
+  if (2 * (state->buildIdFileCount + 1) > state->buildIdFileAlloc)
+  {
+    const unsigned alloc = state->buildIdFileAlloc ? 2 * state->buildIdFileAlloc : 256;
+    char** files = calloc(alloc, sizeof(char*));
+    if (!files)
+      return true;
+    for (unsigned i = 0; i < state->buildIdFileAlloc; i++)
+      if (state->buildIdFiles[i])
+        *findBuildIdFile(files, alloc, state->buildIdFiles[i]) = state->buildIdFiles[i];
+    free(state->buildIdFiles);
+    state->buildIdFiles = files;
+    state->buildIdFileAlloc = alloc;
+  }
+
+  char* name = strdup(fileName);
+  if (!name)
+    return true;
+  *findBuildIdFile(state->buildIdFiles, state->buildIdFileAlloc, name) = name;
+  state->buildIdFileCount++;
+  return true;
+}
+
+static void freeBuildIdFiles(struct PGCollectState* state)
+{
+  for (unsigned i = 0; i < state->buildIdFileAlloc; i++)
+    free(state->buildIdFiles[i]);
+  free(state->buildIdFiles);
+  state->buildIdFiles = NULL;
+  state->buildIdFileCount = 0;
+  state->buildIdFileAlloc = 0;
+}
+
+/* Writes build-id of the mapped file once per file, so pgconvert can find it later in a symbol store. Build-id is
+ * read from the path when its mmap is seen, file replaced after it was mapped gives build-id of the new one. */
+static void writeBuildIdEvent(struct PGCollectState* state, const char* fileName)
+{
+  // [vdso], [anon] and similar don't have files behind them
+  if (fileName[0] != '/' || !addBuildIdFile(state, fileName))
+    return;
+
+  union {
+    struct pg_build_id_event event;
+    char data[sizeof(struct pg_build_id_event) + PATH_MAX];
+  } record;
+  memset(&record.event, 0, sizeof(record.event));
+  record.event.buildIdSize = readBuildId(fileName, record.event.buildId);
+  if (record.event.buildIdSize == 0)
+    return;
+
+  size_t filenameLen = strlen(fileName) + 1;
+  size_t alignedFilenameLen = filenameLen % 8 ? (filenameLen / 8 + 1) * 8 : filenameLen;
+  if (alignedFilenameLen > PATH_MAX)
+    return;
+  memset(record.event.fileName, 0, alignedFilenameLen);
+  memcpy(record.event.fileName, fileName, filenameLen);
+  record.event.header.type = PG_RECORD_BUILD_ID;
+  record.event.header.misc = PERF_RECORD_MISC_USER;
+  record.event.header.size = sizeof(struct pg_build_id_event) + alignedFilenameLen;
+
+  fwrite(&record, record.event.header.size, 1, state->output);
+  state->buildIdCount++;
+}
+
+/* Sample fields are enabled in createPerfEvent, time is also appended to all other records */
+static const __u64 sampleType = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_CALLCHAIN;
+
+static void writeHeaderEvent(struct PGCollectState* state)
+{
+  struct pg_header_event event;
+  memset(&event, 0, sizeof(event));
+  event.header.type = PG_RECORD_HEADER;
+  event.header.size = sizeof(event);
+  event.sampleType = sampleType;
+  event.sampleIdAll = 1;
+  event.flags = PG_HEADER_MONOTONIC_TIME;
+  fwrite(&event, sizeof(event), 1, state->output);
+}
+
 static void collectExistingMappings(struct PGCollectState* state)
 {
   struct mmap_event {
@@ -97,7 +282,7 @@ static void collectExistingMappings(struct PGCollectState* state)
       __u64    addr;
       __u64    len;
       __u64    pgoff;
-      char   filename[PATH_MAX];
+      char   filename[PATH_MAX + 2 * sizeof(__u64)];
   };
 
   char mapFileName[PATH_MAX];
@@ -139,10 +324,14 @@ static void collectExistingMappings(struct PGCollectState* state)
     size_t filenameLen = strlen(event.filename) + 1; // Keep at least one NULL character
     size_t alignedFilenameLen = filenameLen % 8 ? (filenameLen / 8 + 1) * 8 : filenameLen;
     memset(event.filename + filenameLen, 0, alignedFilenameLen - filenameLen);
+    // Trailer has the same ids as the record, mappings existed before profiling started, so their time is zero
+    memcpy(event.filename + alignedFilenameLen, &event.pid, 2 * sizeof(__u32));
+    memset(event.filename + alignedFilenameLen + sizeof(__u64), 0, sizeof(__u64));
     event.header.size = sizeof(struct mmap_event) - PATH_MAX + alignedFilenameLen;
 
     fwrite(&event, event.header.size, 1, state->output);
     state->synthMmapCount++;
+    writeBuildIdEvent(state, event.filename);
   }
 
   fclose(mapFile);
@@ -163,6 +352,10 @@ static void prepareState(struct PGCollectState* state, int argc, char** argv)
   state->sampleCount = 0;
   state->mmapCount = 0;
   state->synthMmapCount = 0;
+  state->buildIdCount = 0;
+  state->buildIdFiles = NULL;
+  state->buildIdFileCount = 0;
+  state->buildIdFileAlloc = 0;
   state->gogoFD = 0;
 
   if (argc < 3)
@@ -174,6 +367,7 @@ static void prepareState(struct PGCollectState* state, int argc, char** argv)
     fprintf(stderr, "Can't create output file %s: %s\n", argv[1], strerror(errno));
     exit(EXIT_FAILURE);
   }
+  writeHeaderEvent(state);
 
   optind = 2;
   int opt;
@@ -308,7 +502,11 @@ static int createPerfEvent(const struct PGCollectState* state, pid_t pid, int cp
     pe_attr.config = PERF_COUNT_HW_CPU_CYCLES;
   }
   pe_attr.sample_freq = state->frequency;
-  pe_attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_CALLCHAIN;
+  pe_attr.sample_type = sampleType;
+  pe_attr.sample_id_all = 1;
+  // Samples are matched with timestamps of jitdump records
+  pe_attr.use_clockid = 1;
+  pe_attr.clockid = CLOCK_MONOTONIC;
   pe_attr.disabled = forkMode;
   pe_attr.inherit = 1;
   pe_attr.exclude_kernel = 1;
@@ -412,16 +610,22 @@ static void processEvents(struct PerfMmapArea* area, struct PGCollectState* stat
       else if (eventHeader->type == PERF_RECORD_SAMPLE)
         state->sampleCount++;
 
+      // Event wrapping around the end of the buffer is glued together
+      char eventCopy[eventHeader->size];
       if ((area->prev & area->mask) + eventHeader->size != ((area->prev + eventHeader->size) & area->mask))
       {
         size_t dataSize = area->mask + 1;
         size_t offset = area->prev & area->mask;
         size_t chunkSize = dataSize - offset;
-        fwrite(eventHeader, chunkSize, 1,  state->output);
-        fwrite(area->data, eventHeader->size - chunkSize, 1, state->output);
+        memcpy(eventCopy, eventHeader, chunkSize);
+        memcpy(eventCopy + chunkSize, area->data, eventHeader->size - chunkSize);
+        eventHeader = (struct perf_event_header*)eventCopy;
       }
-      else
-        fwrite(eventHeader, eventHeader->size, 1, state->output);
+      fwrite(eventHeader, eventHeader->size, 1, state->output);
+
+      // File name follows pid, tid, addr, len and pgoff
+      if (eventHeader->type == PERF_RECORD_MMAP)
+        writeBuildIdEvent(state, (const char*)(eventHeader + 1) + 2 * sizeof(__u32) + 3 * sizeof(__u64));
     }
 
     area->prev += eventHeader->size;
@@ -482,7 +686,9 @@ int main(int argc, char** argv)
 
   puts("Collection stopped.");
   fclose(state.output);
+  freeBuildIdFiles(&state);
   fprintf(stdout, "Waked up %u times\nSythetic mmap events: %u\nReal mmap events: %u\nSample events: %u\n",
           state.wakeupCount, state.synthMmapCount, state.mmapCount, state.sampleCount);
+  fprintf(stdout, "Build-id records: %u\n", state.buildIdCount);
   fprintf(stdout, "Total %u events written\n", state.synthMmapCount + state.mmapCount + state.sampleCount);
 }
@@ -1,27 +1,43 @@
 #include "Profile.h"
 #include "AddressResolver.h"
+#include "CallgrindWriter.h"
+#include "CommandLine.h"
+#include "FoldedWriter.h"
+#include "Parallel.h"
+#include "PprofWriter.h"
 
 #include <algorithm>
 #include <fstream>
 #include <iostream>
-#include <numeric>
+#include <memory>
 #include <cerrno>
 #include <cstdlib>
 #include <cstring>
 
 #include <getopt.h>
 
-struct Params
+enum class OutputFormat
+{
+  Callgrind,
+  Folded,
+  Pprof,
+  Resolved
+};
+
+struct Params: ResolveOptions
 {
   Params()
   : dumpInstructions(false)
-  , inputFile(0)
-  , outputFile("-")
-  {}
-  ProfileMode mode = ProfileMode::CallGraph;
+  , outputFile(0)
+  {
+  }
   ProfileDetails details = ProfileDetails::Sources;
+  OutputFormat format = OutputFormat::Callgrind;
   bool dumpInstructions;
-  const char* inputFile;
+  ProfilePruning pruning;
+  size_t maxContexts = CallTree::DefaultMaxNodes;
+  ProfileFilter filter;
+  std::vector<const char*> inputFiles;
   const char* outputFile;
 };
 
@@ -29,29 +45,59 @@ static void __attribute__((noreturn))
 printUsage()
 {
   std::cout << "Usage: " << program_invocation_short_name
-            << " [-m {flat|callgraph}] [-d {object|symbol|source}] [-i] filename.pgdata [filename.grind]"
+            << " [-m {flat|callgraph}] [-d {object|symbol|source|inline}] [-f {callgrind|folded|pprof|pgprof}] [-i]"
+               " [-j jobs] [--min-cost percent] [--top count] [--max-contexts count]"
+               " [--{include|exclude}-object glob]... [--{include|exclude}-symbol regex]..."
+               " [--{include|exclude}-pid id]... [-c cachedir] [-s debugdir]... [-S storedir] [-a symbolpack]"
+               " {filename.{pgdata|pgprof} [filename.grind] | -o filename.grind filename.pgdata...}"
             << "\n";
   exit(EXIT_SUCCESS);
 }
 
+// Options without short form
+enum LongOption
+{
+  MinCostOption = 256,
+  TopOption,
+  MaxContextsOption,
+  IncludeObjectOption,
+  ExcludeObjectOption,
+  IncludeSymbolOption,
+  ExcludeSymbolOption,
+  IncludePidOption,
+  ExcludePidOption
+};
+
+static std::regex parseRegex(const char* value)
+{
+  try
+  {
+    return std::regex(value, std::regex::optimize);
+  }
+  catch (const std::regex_error& error)
+  {
+    std::cerr << "Invalid symbol pattern '" << value << "': " << error.what() << '\n';
+    exit(EXIT_FAILURE);
+  }
+}
+
 static void parseArguments(Params& params, int argc, char* argv[])
 {
+  static const option longOptions[] = {{"min-cost", required_argument, nullptr, MinCostOption},
+                                       {"top", required_argument, nullptr, TopOption},
+                                       {"max-contexts", required_argument, nullptr, MaxContextsOption},
+                                       {"include-object", required_argument, nullptr, IncludeObjectOption},
+                                       {"exclude-object", required_argument, nullptr, ExcludeObjectOption},
+                                       {"include-symbol", required_argument, nullptr, IncludeSymbolOption},
+                                       {"exclude-symbol", required_argument, nullptr, ExcludeSymbolOption},
+                                       {"include-pid", required_argument, nullptr, IncludePidOption},
+                                       {"exclude-pid", required_argument, nullptr, ExcludePidOption},
+                                       {nullptr, 0, nullptr, 0}};
   int opt;
-  while ((opt = getopt(argc, argv, "m:d:i")) != -1)
+  while ((opt = getopt_long(argc, argv, "m:d:f:ij:o:c:s:S:a:", longOptions, nullptr)) != -1)
   {
     switch (opt)
     {
-    case 'm':
-      if (strcmp(optarg, "flat") == 0)
-        params.mode = ProfileMode::Flat;
-      else if (strcmp(optarg, "callgraph") == 0)
-        params.mode = ProfileMode::CallGraph;
-      else
-      {
-        std::cerr << "Invalid mode '" << optarg <<"'\n";
-        exit(EXIT_FAILURE);
-      }
-      break;
     case 'd':
       if (strcmp(optarg, "object") == 0)
         params.details = ProfileDetails::Objects;
@@ -59,196 +105,196 @@ static void parseArguments(Params& params, int argc, char* argv[])
         params.details = ProfileDetails::Symbols;
       else if (strcmp(optarg, "source") == 0)
         params.details = ProfileDetails::Sources;
+      else if (strcmp(optarg, "inline") == 0)
+        params.details = ProfileDetails::Inlines;
       else
       {
         std::cerr << "Invalid details level '" << optarg <<"'\n";
         exit(EXIT_FAILURE);
       }
       break;
+    case 'f':
+      if (strcmp(optarg, "callgrind") == 0)
+        params.format = OutputFormat::Callgrind;
+      else if (strcmp(optarg, "folded") == 0)
+        params.format = OutputFormat::Folded;
+      else if (strcmp(optarg, "pprof") == 0)
+        params.format = OutputFormat::Pprof;
+      else if (strcmp(optarg, "pgprof") == 0)
+        params.format = OutputFormat::Resolved;
+      else
+      {
+        std::cerr << "Invalid output format '" << optarg << "'\n";
+        exit(EXIT_FAILURE);
+      }
+      break;
     case 'i':
       params.dumpInstructions = true;
       break;
+    case MinCostOption: {
+      // Percent sign is optional
+      char* endptr;
+      params.pruning.minCost = strtod(optarg, &endptr);
+      if (*endptr == '%')
+        ++endptr;
+      if (*endptr != 0 || endptr == optarg || params.pruning.minCost < 0 || params.pruning.minCost > 100)
+      {
+        std::cerr << "Invalid minimal cost '" << optarg << "'\n";
+        exit(EXIT_FAILURE);
+      }}
+      break;
+    case TopOption: {
+      char* endptr;
+      params.pruning.top = strtoul(optarg, &endptr, 10);
+      if (*endptr != 0 || params.pruning.top == 0)
+      {
+        std::cerr << "Invalid number of symbols '" << optarg << "'\n";
+        exit(EXIT_FAILURE);
+      }}
+      break;
+    case MaxContextsOption: {
+      char* endptr;
+      params.maxContexts = strtoul(optarg, &endptr, 10);
+      if (*endptr != 0 || params.maxContexts == 0)
+      {
+        std::cerr << "Invalid number of contexts '" << optarg << "'\n";
+        exit(EXIT_FAILURE);
+      }}
+      break;
+    case IncludeObjectOption:
+      params.filter.includeObjects.push_back(optarg);
+      break;
+    case ExcludeObjectOption:
+      params.filter.excludeObjects.push_back(optarg);
+      break;
+    case IncludeSymbolOption:
+      params.filter.includeSymbols.push_back(parseRegex(optarg));
+      break;
+    case ExcludeSymbolOption:
+      params.filter.excludeSymbols.push_back(parseRegex(optarg));
+      break;
+    case IncludePidOption:
+      params.filter.includeIds.push_back(parseIdArgument(optarg));
+      break;
+    case ExcludePidOption:
+      params.filter.excludeIds.push_back(parseIdArgument(optarg));
+      break;
+    case 'o':
+      params.outputFile = optarg;
+      break;
     default:
-      printUsage();
+      if (!params.parseOption(opt, optarg))
+        printUsage();
     }
   }
 
-  if (argc - optind >= 1 && argc - optind <= 2 )
+  // Without output option the second file is the output one
+  if (params.outputFile && argc - optind >= 1)
+    params.inputFiles.assign(argv + optind, argv + argc);
+  else if (!params.outputFile && argc - optind >= 1 && argc - optind <= 2 )
   {
-    params.inputFile = argv[optind++];
-    if (optind < argc)
-      params.outputFile = argv[optind];
+    params.inputFiles.push_back(argv[optind++]);
+    params.outputFile = optind < argc ? argv[optind] : "-";
   }
   else
     printUsage();
 
-  // It is not possible to use callgraphs with objects only
-  if (params.details == ProfileDetails::Objects)
-    params.mode = ProfileMode::Flat;
-}
+  // Symbol packs have no inlining info, objects resolved from them would silently lose inlined functions
+  if (params.details == ProfileDetails::Inlines && !params.symbolLocations.symbolPack.empty())
+  {
+    std::cerr << "Detail level 'inline' can't be used with symbol pack\n";
+    exit(EXIT_FAILURE);
+  }
 
-static void dumpCallTo(std::ostream& os, const MemoryObjectData& callObjectData, const SymbolData& callSymbolData)
-{
-  os << "cob=" << callObjectData.fileName()
-     << "\ncfi=" << callSymbolData.sourceFile()
-     << "\ncfn=" << callSymbolData.name() << '\n';
+  // It is not possible to use callgraphs with objects only in callgrind format
+  if (params.details == ProfileDetails::Objects && params.format == OutputFormat::Callgrind)
+    params.mode = ProfileMode::Flat;
 }
 
-struct EntrySum
+static bool write(std::ostream& os, const Profile& profile, const Params& params)
 {
-  EntrySum() : count(0) {}
-  std::map<const Symbol*, Count> branches;
-  Count count;
-};
-
-typedef std::map<size_t, EntrySum> ByLine;
-
-typedef std::map<const std::string*, ByLine> ByFileByLine;
-
-struct EntryGroupper
-{
-  ByFileByLine& operator()(ByFileByLine& group, const Entry& entry) const
+  switch (params.format)
   {
-    const EntryData& entryData = entry.second;
-    EntrySum& groupData = group[&entryData.sourceFile()][entryData.sourceLine()];
-    groupData.count += entryData.count();
-
-    for (const auto& branch: entryData.branches())
-      groupData.branches[branch.first.symbol] += branch.second;
-
-    return group;
+  case OutputFormat::Callgrind:
+    return writeCallgrind(os, profile, params.dumpInstructions, params.jobs);
+  case OutputFormat::Folded:
+    return writeFolded(os, profile, params.details);
+  case OutputFormat::Pprof:
+    return writePprof(os, profile, params.details);
+  case OutputFormat::Resolved:
+    return profile.writeResolved(os);
   }
-};
+  return true;
+}
 
-static void dumpEntriesWithoutInstructions(std::ostream& os, const MemoryObjectStorage& objects,
-                                    const std::string* fileName,
-                                    EntryStorage::const_iterator entryFirst,
-                                    EntryStorage::const_iterator entryLast)
+static std::unique_ptr<Profile> loadResolved(const Params& params)
 {
-  const ByFileByLine& total = std::accumulate(entryFirst, entryLast, ByFileByLine(), EntryGroupper());
-
-  // We want to dump summary for current file first
-  ByFileByLine::const_iterator currFileIt = total.find(fileName);
-  ByFileByLine::const_iterator byFileByLineIt = currFileIt;
-  if (byFileByLineIt == total.end())
-    byFileByLineIt = total.begin();
-  bool currentFileDone = (currFileIt == total.end());
-
-  while (byFileByLineIt != total.end())
+  // Resolved profile keeps no samples, so it can't be changed in any other way
+  if (params.inputFiles.size() > 1 || params.filter.isEnabled() || params.pruning.isEnabled())
   {
-    if (currentFileDone && byFileByLineIt == currFileIt)
-    {
-      ++byFileByLineIt;
-      continue;
-    }
-
-    const std::string& fileName = *(byFileByLineIt->first);
-    const ByLine& byLine = byFileByLineIt->second;
-
-    if (currentFileDone)
-      os << "fi=" << fileName << '\n';
-
-    for (const auto& byLineElem: byLine)
-    {
-      const size_t line = byLineElem.first;
-      const EntrySum& entrySum = byLineElem.second;
-
-      if (entrySum.count)
-        os << line << ' ' << entrySum.count << '\n';
-
-      for (const auto& branch: entrySum.branches)
-      {
-        const Symbol* callSymbol = branch.first;
-        const MemoryObjectData& callObjectData = objects.at(Range(callSymbol->first.start()));
-        dumpCallTo(os, callObjectData, callSymbol->second);
-        os << "calls=1 " << callSymbol->second.sourceLine() << '\n';
-        os << line << ' ' << branch.second << '\n';
-      }
-    }
-    if (!currentFileDone)
-    {
-      byFileByLineIt = total.begin();
-      currentFileDone = true;
-    }
-    else
-      ++byFileByLineIt;
+    std::cerr << "Resolved profile can't be merged, filtered or pruned\n";
+    exit(EXIT_FAILURE);
   }
+
+  std::unique_ptr<Profile> profile(new Profile);
+  if (!profile->loadResolved(params.inputFiles.front(), params.details, params.mode))
+    exit(EXIT_FAILURE);
+  return profile;
 }
 
-static void dumpEntriesWithInstructions(std::ostream& os, const MemoryObject& currentObject,
-                                        const MemoryObjectStorage& allObjects, const std::string* fileName,
-                                        EntryStorage::const_iterator entryFirst, EntryStorage::const_iterator entryLast)
+static std::unique_ptr<Profile> loadAndResolve(const Params& params)
 {
-  for (; entryFirst != entryLast; ++entryFirst)
+  std::vector<std::unique_ptr<std::fstream>> inputs;
+  for (const char* inputFile: params.inputFiles)
   {
-    Address entryAddress = currentObject.second.mapToElf(currentObject.first.start(), entryFirst->first);
-    const EntryData& entryData = entryFirst->second;
-
-    if (fileName != &entryData.sourceFile())
+    inputs.emplace_back(new std::fstream(inputFile, std::ios_base::in));
+    if (!*inputs.back())
     {
-      fileName = &entryData.sourceFile();
-      os << "fi=" << *fileName << '\n';
-    }
-
-    if (entryData.count())
-      os << "0x" << std::hex << entryAddress << std::dec << ' ' << entryData.sourceLine() << ' '
-         << entryData.count() << '\n';
-
-    for (const auto& branch: entryFirst->second.branches())
-    {
-      const Symbol* callSymbol = branch.first.symbol;
-      const MemoryObject& callObject = *allObjects.find(Range(callSymbol->first.start()));
-      Address callAddress = callObject.second.mapToElf(callObject.first.start(), callSymbol->first.start());
-      dumpCallTo(os, callObject.second, callSymbol->second);
-      os << "calls=1 0x" << std::hex << callAddress << std::dec << ' ' << callSymbol->second.sourceLine() << '\n';
-      os << "0x" << std::hex << entryAddress << std::dec << ' ' << entryData.sourceLine() << ' ' << branch.second
-         << '\n';
+      std::cerr << "Error reading input file " << inputFile << '\n';
+      exit(EXIT_FAILURE);
     }
   }
-}
 
-static void dump(std::ostream& os, const Profile& profile, bool dumpInstructions)
-{
-  os << "positions:";
-  if (dumpInstructions)
-    os << " instr";
-  os <<" line\n";
-
-  os << "events: Cycles\n\n";
+  // Captures are loaded independently and merged in the order of inputs as soon as all earlier ones are, so output
+  // doesn't depend on timing and only a few loaded captures wait. Merging costs only as much as their unique entries
+  // and contexts.
+  std::unique_ptr<Profile> merged;
+  std::vector<char> withoutIds(inputs.size());
+  parallelOrdered<std::unique_ptr<Profile>>(
+    inputs.size(), params.jobs,
+    [&](size_t i) {
+      std::unique_ptr<Profile> profile(new Profile);
+      profile->setFilter(params.filter);
+      profile->setMaxContexts(params.maxContexts);
+      profile->setSymbolLocations(&params.symbolLocations);
+      profile->load(*inputs[i], params.mode);
+      inputs[i].reset();
+      withoutIds[i] = !profile->hasThreadIds();
+      return profile;
+    },
+    [&](std::unique_ptr<Profile>& profile) {
+      if (merged)
+        merged->merge(*profile);
+      else
+        merged = std::move(profile);
+      profile.reset();
+    });
 
-  for (const auto& object: profile.memoryObjects())
+  // Samples without ids would be all dropped or all kept by id filters
+  for (size_t i = 0; i < inputs.size(); ++i)
   {
-    os << "ob=" << object.second.fileName() << '\n';
-
-    const EntryStorage& entries = object.second.entries();
-    const SymbolStorage& symbols = object.second.symbols();
-
-    const std::string* fileName = 0;
-
-    for (const auto& symbol: symbols)
+    if (params.filter.filtersThreads() && withoutIds[i])
     {
-      const Range& symbolRange = symbol.first;
-      const SymbolData& symbolData = symbol.second;
-
-      if (!fileName || fileName != &symbolData.sourceFile())
-      {
-        fileName = &symbolData.sourceFile();
-        os << "fl=" << *fileName << '\n';
-      }
-      os << "fn=" << symbolData.name() << '\n';
-
-      EntryStorage::const_iterator entryFirst = entries.lower_bound(symbolRange.start());
-      EntryStorage::const_iterator entryLast = entries.upper_bound(symbolRange.end());
-
-      if (dumpInstructions)
-      {
-        dumpEntriesWithInstructions(os, object, profile.memoryObjects(), fileName, entryFirst, entryLast);
-      }
-      else
-        dumpEntriesWithoutInstructions(os, profile.memoryObjects(), fileName, entryFirst, entryLast);
+      std::cerr << "Input file " << params.inputFiles[i]
+                << " has no process and thread ids, it can't be filtered by them\n";
+      exit(EXIT_FAILURE);
     }
-    os << '\n';
   }
+
+  merged->resolveAndFixup(params.details, params.symbolLocations, params.jobs, params.pruning);
+  for (const std::string& fileName: merged->mismatchedFiles())
+    std::cerr << "Build-id of " << fileName << " differs from the recorded one, the file was skipped\n";
+  return merged;
 }
 
 int main(int argc, char** argv)
@@ -256,18 +302,13 @@ int main(int argc, char** argv)
   Params params;
   parseArguments(params, argc, argv);
 
-  std::fstream input(params.inputFile, std::ios_base::in);
-  if (!input)
-  {
-    std::cerr << "Error reading input file " << params.inputFile << '\n';
-    exit(EXIT_FAILURE);
-  }
-
-  Profile profile;
-  profile.load(input, params.mode);
-  input.close();
-
-  profile.resolveAndFixup(params.details);
+  // Resolved profile among several inputs is rejected, it is never read as collected samples
+  const bool resolved = std::any_of(params.inputFiles.begin(), params.inputFiles.end(), &Profile::isResolvedProfile);
+  const std::unique_ptr<Profile> profilePtr = resolved ? loadResolved(params) : loadAndResolve(params);
+  const Profile& profile = *profilePtr;
+  if (profile.callTree().truncatedSamples())
+    std::cerr << "Call tree is full, contexts of " << profile.callTree().truncatedSamples()
+              << " samples were cut, use --max-contexts to keep more of them\n";
 
   if (strcmp("-", params.outputFile))
   {
@@ -277,10 +318,17 @@ int main(int argc, char** argv)
       std::cerr << "Can't write to the output file " << params.outputFile << '\n';
       exit(EXIT_FAILURE);
     }
-    dump(out, profile, params.dumpInstructions);
+    if (!write(out, profile, params))
+    {
+      std::cerr << "Error writing the output file " << params.outputFile << '\n';
+      exit(EXIT_FAILURE);
+    }
+  }
+  else if (!write(std::cout, profile, params))
+  {
+    std::cerr << "Error writing the output\n";
+    exit(EXIT_FAILURE);
   }
-  else
-    dump(std::cout, profile, params.dumpInstructions);
 
   return 0;
 }
@@ -0,0 +1,42 @@
+#pragma once
+
+/* Records which pgcollect adds to the stream of perf events in .pgdata files.
+ * This header is shared between C and C++ code. */
+
+#include <linux/perf_event.h>
+
+/* Types of perfgrind own records, far above the ones used by the kernel */
+enum pg_record_type
+{
+  PG_RECORD_BUILD_ID = 0x10000,
+  PG_RECORD_HEADER = 0x10001
+};
+
+/* Flags of pg_header_event */
+enum pg_header_flags
+{
+  /* Times come from CLOCK_MONOTONIC, the clock of jitdump records */
+  PG_HEADER_MONOTONIC_TIME = 1
+};
+
+/* First record of the file describing layout of perf records. Files without it have samples with
+ * PERF_SAMPLE_IP | PERF_SAMPLE_CALLCHAIN and no sample_id_all. */
+struct pg_header_event
+{
+  struct perf_event_header header;
+  __u64 sampleType;
+  __u32 sampleIdAll;
+  __u32 flags;
+};
+
+#define PG_BUILD_ID_MAX_SIZE 20
+
+/* Build-id of the file mapped by preceding mmap events with the same file name */
+struct pg_build_id_event
+{
+  struct perf_event_header header;
+  __u8 buildIdSize;
+  __u8 reserved[3];
+  __u8 buildId[PG_BUILD_ID_MAX_SIZE];
+  char fileName[]; /* NUL terminated, padded to 8 bytes */
+};
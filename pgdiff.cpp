@@ -0,0 +1,126 @@
+#include "Profile.h"
+#include "AddressResolver.h"
+#include "CommandLine.h"
+#include "Parallel.h"
+#include "ProfileDiff.h"
+
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+struct Params: ResolveOptions
+{
+  double minChange = 0.1;
+  size_t reportCount = 20;
+  const char* inputFiles[2] = {nullptr, nullptr};
+  const char* outputFile = nullptr;
+};
+
+static void __attribute__((noreturn))
+printUsage()
+{
+  std::cout << "Usage: " << program_invocation_short_name
+            << " [-m {flat|callgraph}] [-j jobs] [-t percent] [-n count] [-c cachedir] [-s debugdir]... [-S storedir]"
+               " [-a symbolpack] before.pgdata after.pgdata [diff.grind]\n";
+  exit(EXIT_SUCCESS);
+}
+
+static void parseArguments(Params& params, int argc, char* argv[])
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "m:j:t:n:c:s:S:a:")) != -1)
+  {
+    switch (opt)
+    {
+    case 't': {
+      // Percent sign is optional
+      char* endptr;
+      params.minChange = strtod(optarg, &endptr);
+      if (*endptr == '%')
+        ++endptr;
+      if (*endptr != 0 || endptr == optarg || params.minChange < 0 || params.minChange > 100)
+      {
+        std::cerr << "Invalid threshold '" << optarg << "'\n";
+        exit(EXIT_FAILURE);
+      }}
+      break;
+    case 'n': {
+      char* endptr;
+      params.reportCount = strtoul(optarg, &endptr, 10);
+      if (*endptr != 0 || endptr == optarg)
+      {
+        std::cerr << "Invalid number of symbols '" << optarg << "'\n";
+        exit(EXIT_FAILURE);
+      }}
+      break;
+    default:
+      if (!params.parseOption(opt, optarg))
+        printUsage();
+    }
+  }
+
+  if (argc - optind < 2 || argc - optind > 3)
+    printUsage();
+  params.inputFiles[0] = argv[optind++];
+  params.inputFiles[1] = argv[optind++];
+  if (optind < argc)
+    params.outputFile = argv[optind];
+}
+
+int main(int argc, char** argv)
+{
+  Params params;
+  parseArguments(params, argc, argv);
+
+  std::unique_ptr<std::fstream> inputs[2];
+  for (size_t i = 0; i < 2; ++i)
+  {
+    inputs[i].reset(new std::fstream(params.inputFiles[i], std::ios_base::in));
+    if (!*inputs[i])
+    {
+      std::cerr << "Error reading input file " << params.inputFiles[i] << '\n';
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  Profile profiles[2];
+  parallelFor(2, params.jobs, [&](size_t i) {
+    profiles[i].setSymbolLocations(&params.symbolLocations);
+    profiles[i].load(*inputs[i], params.mode);
+    inputs[i].reset();
+  });
+
+  // Builds differ, so profiles are compared by symbol names, not by addresses
+  for (Profile& profile: profiles)
+  {
+    profile.resolveAndFixup(ProfileDetails::Symbols, params.symbolLocations, params.jobs);
+    for (const std::string& fileName: profile.mismatchedFiles())
+      std::cerr << "Build-id of " << fileName << " differs from the recorded one, the file was skipped\n";
+  }
+
+  ProfileDiff diff(profiles[0], profiles[1]);
+  diff.writeReport(std::cout, params.reportCount);
+
+  if (params.outputFile)
+  {
+    diff.prune(params.minChange);
+    std::ofstream out(params.outputFile);
+    if (!out)
+    {
+      std::cerr << "Can't write to the output file " << params.outputFile << '\n';
+      exit(EXIT_FAILURE);
+    }
+    if (!diff.writeCallgrind(out))
+    {
+      std::cerr << "Error writing the output file " << params.outputFile << '\n';
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  return 0;
+}
@@ -1,4 +1,5 @@
 #include "Profile.h"
+#include "CommandLine.h"
 
 #include <fstream>
 #include <iostream>
@@ -6,47 +7,128 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <getopt.h>
+
+// Options without short form
+enum LongOption
+{
+  IncludeObjectOption = 256,
+  ExcludeObjectOption,
+  IncludePidOption,
+  ExcludePidOption
+};
+
+static void __attribute__((noreturn))
+printUsage()
+{
+  std::cout << "Usage: " << program_invocation_short_name
+            << " [--{include|exclude}-object glob]... [--{include|exclude}-pid id]... {flat|callgraph}"
+               " filename.{pgdata|pgprof}\n";
+  exit(EXIT_SUCCESS);
+}
+
 int main(int argc, char** argv)
 {
-  if (argc < 3)
+  static const option longOptions[] = {{"include-object", required_argument, nullptr, IncludeObjectOption},
+                                       {"exclude-object", required_argument, nullptr, ExcludeObjectOption},
+                                       {"include-pid", required_argument, nullptr, IncludePidOption},
+                                       {"exclude-pid", required_argument, nullptr, ExcludePidOption},
+                                       {nullptr, 0, nullptr, 0}};
+  ProfileFilter filter;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", longOptions, nullptr)) != -1)
   {
-    std::cout << "Usage: " << program_invocation_short_name << " {flat|callgraph} filename.pgdata\n";
-    exit(EXIT_SUCCESS);
+    switch (opt)
+    {
+    case IncludeObjectOption:
+      filter.includeObjects.push_back(optarg);
+      break;
+    case ExcludeObjectOption:
+      filter.excludeObjects.push_back(optarg);
+      break;
+    case IncludePidOption:
+      filter.includeIds.push_back(parseIdArgument(optarg));
+      break;
+    case ExcludePidOption:
+      filter.excludeIds.push_back(parseIdArgument(optarg));
+      break;
+    default:
+      printUsage();
+    }
   }
 
+  if (argc - optind < 2)
+    printUsage();
+  const char* modeName = argv[optind];
+  const char* inputFile = argv[optind + 1];
+
   ProfileMode mode;
-  if (strcmp(argv[1], "flat") == 0)
+  if (strcmp(modeName, "flat") == 0)
     mode = ProfileMode::Flat;
-  else if (strcmp(argv[1], "callgraph") == 0)
+  else if (strcmp(modeName, "callgraph") == 0)
     mode = ProfileMode::CallGraph;
   else
   {
-    std::cerr << "Invalid mode '" << argv[1] <<"'\n";
+    std::cerr << "Invalid mode '" << modeName <<"'\n";
     exit(EXIT_FAILURE);
   }
 
-  std::fstream input(argv[2], std::ios_base::in);
-  if (!input)
+  // All details of resolved profile are shown
+  Profile profile;
+  const bool resolved = Profile::isResolvedProfile(inputFile);
+  if (resolved)
   {
-    std::cerr << "Error reading input file " << argv[1] << '\n';
-    exit(EXIT_FAILURE);
+    if (filter.isEnabled())
+    {
+      std::cerr << "Resolved profile can't be filtered\n";
+      exit(EXIT_FAILURE);
+    }
+    if (!profile.loadResolved(inputFile, ProfileDetails::Inlines, mode))
+      exit(EXIT_FAILURE);
+  }
+  else
+  {
+    std::fstream input(inputFile, std::ios_base::in);
+    if (!input)
+    {
+      std::cerr << "Error reading input file " << inputFile << '\n';
+      exit(EXIT_FAILURE);
+    }
+    profile.setFilter(filter);
+    profile.load(input, mode);
+    if (filter.filtersThreads() && !profile.hasThreadIds())
+    {
+      std::cerr << "Input file " << inputFile << " has no process and thread ids, it can't be filtered by them\n";
+      exit(EXIT_FAILURE);
+    }
   }
-
-  Profile profile;
-  profile.load(input, mode);
-  input.close();
 
   size_t entryCount = 0;
+  size_t symbolCount = 0;
   for (const auto& memoryObject: profile.memoryObjects())
+  {
     entryCount += memoryObject.second.entries().size();
+    symbolCount += memoryObject.second.symbols().size();
+  }
+  if (resolved)
+  {
+    static const char* const detailNames[] = {"object", "symbol", "source", "inline"};
+    std::cout << "resolved details: " << detailNames[static_cast<int>(profile.details())]
+              << "\nresolved symbols: " << symbolCount << '\n';
+  }
 
   std::cout << "memory objects: " << profile.memoryObjects().size() << "\nentries: " << entryCount
+            << "\ncall tree nodes: " << profile.callTree().nodes().size() - 1
+            << "\ntruncated call tree samples: " << profile.callTree().truncatedSamples()
             << "\n\nmmap events: " << profile.mmapEventCount() << "\ngood sample events: " << profile.goodSamplesCount()
             << "\nnon-user sample events: " << profile.nonUserSamples()
-            << "\nunmapped sample events: " << profile.unmappedSamples() << "\ntotal sample events: "
-            << profile.goodSamplesCount() + profile.nonUserSamples() + profile.unmappedSamples() << "\ntotal events: "
+            << "\nunmapped sample events: " << profile.unmappedSamples()
+            << "\nfiltered sample events: " << profile.filteredSamples() << "\ntotal sample events: "
+            << profile.goodSamplesCount() + profile.nonUserSamples() + profile.unmappedSamples() +
+                 profile.filteredSamples()
+            << "\ntotal events: "
             << profile.goodSamplesCount() + profile.goodSamplesCount() + profile.nonUserSamples() +
-                 profile.unmappedSamples()
+                 profile.unmappedSamples() + profile.filteredSamples()
             << '\n';
 
   return 0;